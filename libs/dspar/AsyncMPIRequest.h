@@ -1,18 +1,64 @@
 #pragma once
 
 #include "mpi.h"
+#include <memory>
 #include <iostream>
+#include <cassert>
 namespace dspar
 {
+    //Handle to a non-blocking MPI operation. The buffer and the request live on the heap and are shared
+    //by every copy of the handle, so it can be returned and stored by value while MPI still uses the buffer.
+    //The operation must be completed with Await or Test before the last handle is dropped; the sender does
+    //this for the demand signals it posts before the node stops, while MPI is still initialized.
     template <typename T>
     struct AsyncMPIRequest
     {
-        T data;
-        MPI_Request request;
+        struct State
+        {
+            T data;
+            MPI_Request request = MPI_REQUEST_NULL;
+
+            //waiting here could run after MPI_Finalize, the owner completes the operation first
+            ~State()
+            {
+                assert(request == MPI_REQUEST_NULL);
+            }
+        };
+
+        std::shared_ptr<State> state;
+
+        AsyncMPIRequest() : state(std::make_shared<State>()) {}
+
+        T &Data()
+        {
+            return state->data;
+        }
+
+        MPI_Request *Request()
+        {
+            return &state->request;
+        }
+
+        //requests already completed (or never posted, as with in-process transports) return right away
         void Await()
         {
+            if (state->request == MPI_REQUEST_NULL)
+            {
+                return;
+            }
             MPI_Status status;
-            MPI_Wait(&request, &status);
+            MPI_Wait(&state->request, &status);
+        }
+
+        bool Test()
+        {
+            if (state->request == MPI_REQUEST_NULL)
+            {
+                return true;
+            }
+            int done = 0;
+            MPI_Test(&state->request, &done, MPI_STATUS_IGNORE);
+            return done != 0;
         }
     };
 } // namespace dspar
\ No newline at end of file
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace dspar
+{
+	//LZ4-style block codec. A block is a list of sequences: literals copied as they are, then a match
+	//copying bytes already decoded (2-byte offset, length of at least 4). Matches are found through a hash
+	//table of 4-byte prefixes, probed once per position, and the search speeds up over data that does not
+	//compress. Meant for throughput on bandwidth-bound edges, not for ratio.
+	class BlockCodec
+	{
+	private:
+		static const size_t MIN_MATCH = 4;
+		static const size_t MAX_OFFSET = 65535;
+		//the last match starts this far before the end, and the last bytes are always literals
+		static const size_t MATCH_FIND_LIMIT = 12;
+		static const size_t LAST_LITERALS = 5;
+
+		//position + 1 of the last 4 bytes seen with each hash, 0 when empty
+		std::vector<uint32_t> table;
+
+		static uint32_t Read32(const uint8_t *p)
+		{
+			uint32_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static void WriteLength(uint8_t *&op, size_t length)
+		{
+			while (length >= 255)
+			{
+				*op++ = 255;
+				length -= 255;
+			}
+			*op++ = (uint8_t)length;
+		}
+
+		static bool ReadLength(const uint8_t *&ip, const uint8_t *end, size_t &length)
+		{
+			uint8_t byte;
+			do
+			{
+				if (ip >= end)
+				{
+					return false;
+				}
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+			return true;
+		}
+
+		static void WriteSequence(uint8_t *&op, const uint8_t *literals, size_t literalBytes, size_t offset, size_t matchBytes)
+		{
+			uint8_t *token = op++;
+			size_t matchCode = matchBytes - MIN_MATCH;
+			*token = (uint8_t)((std::min(literalBytes, (size_t)15) << 4) | std::min(matchCode, (size_t)15));
+			if (literalBytes >= 15)
+			{
+				WriteLength(op, literalBytes - 15);
+			}
+			memcpy(op, literals, literalBytes);
+			op += literalBytes;
+			*op++ = (uint8_t)(offset & 255);
+			*op++ = (uint8_t)(offset >> 8);
+			if (matchCode >= 15)
+			{
+				WriteLength(op, matchCode - 15);
+			}
+		}
+
+	public:
+		static size_t MaxCompressedSize(size_t bytes)
+		{
+			return bytes + bytes / 255 + 16;
+		}
+
+		//Compresses bytes of source into target, which must hold MaxCompressedSize(bytes). Returns the
+		//compressed size. level (1 to 6) grows the match table from 2^11 to 2^16 entries.
+		size_t Compress(const char *source, size_t bytes, char *target, int level)
+		{
+			const uint8_t *begin = (const uint8_t *)source;
+			const uint8_t *end = begin + bytes;
+			const uint8_t *anchor = begin;
+			uint8_t *op = (uint8_t *)target;
+
+			if (bytes > MATCH_FIND_LIMIT)
+			{
+				//small blocks do not need the whole table, clearing it is part of the cost
+				int hashLog = 10 + std::max(1, std::min(level, 6));
+				while (hashLog > 8 && ((size_t)1 << (hashLog - 1)) >= bytes)
+				{
+					hashLog--;
+				}
+				table.assign((size_t)1 << hashLog, 0);
+
+				const uint8_t *ip = begin;
+				const uint8_t *matchFindLimit = end - MATCH_FIND_LIMIT;
+				const uint8_t *matchLimit = end - LAST_LITERALS;
+				while (ip < matchFindLimit)
+				{
+					uint32_t hash = (Read32(ip) * 2654435761u) >> (32 - hashLog);
+					uint32_t candidate = table[hash];
+					uint32_t position = (uint32_t)(ip - begin);
+					table[hash] = position + 1;
+
+					if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET || Read32(begin + candidate - 1) != Read32(ip))
+					{
+						//step further the longer nothing matched
+						ip += 1 + ((ip - anchor) >> 6);
+						continue;
+					}
+
+					const uint8_t *match = begin + candidate - 1;
+					size_t length = MIN_MATCH;
+					while (ip + length < matchLimit && ip[length] == match[length])
+					{
+						length++;
+					}
+					WriteSequence(op, anchor, ip - anchor, ip - match, length);
+					ip += length;
+					anchor = ip;
+				}
+			}
+
+			size_t literalBytes = end - anchor;
+			*op++ = (uint8_t)(std::min(literalBytes, (size_t)15) << 4);
+			if (literalBytes >= 15)
+			{
+				WriteLength(op, literalBytes - 15);
+			}
+			if (literalBytes > 0)
+			{
+				memcpy(op, anchor, literalBytes);
+			}
+			op += literalBytes;
+			return op - (uint8_t *)target;
+		}
+
+		//Decompresses a block into target, false when it is corrupt or does not decode to exactly rawBytes
+		static bool Decompress(const char *source, size_t bytes, char *target, size_t rawBytes)
+		{
+			const uint8_t *ip = (const uint8_t *)source;
+			const uint8_t *end = ip + bytes;
+			uint8_t *begin = (uint8_t *)target;
+			uint8_t *op = begin;
+			uint8_t *outputEnd = begin + rawBytes;
+
+			while (ip < end)
+			{
+				uint8_t token = *ip++;
+				size_t literalBytes = token >> 4;
+				if (literalBytes == 15 && !ReadLength(ip, end, literalBytes))
+				{
+					return false;
+				}
+				if (literalBytes > (size_t)(end - ip) || literalBytes > (size_t)(outputEnd - op))
+				{
+					return false;
+				}
+				if (literalBytes > 0)
+				{
+					memcpy(op, ip, literalBytes);
+				}
+				op += literalBytes;
+				ip += literalBytes;
+				if (ip == end)
+				{
+					break;
+				}
+
+				if (end - ip < 2)
+				{
+					return false;
+				}
+				size_t offset = ip[0] | (ip[1] << 8);
+				ip += 2;
+				size_t matchBytes = token & 15;
+				if (matchBytes == 15 && !ReadLength(ip, end, matchBytes))
+				{
+					return false;
+				}
+				matchBytes += MIN_MATCH;
+				if (offset == 0 || offset > (size_t)(op - begin) || matchBytes > (size_t)(outputEnd - op))
+				{
+					return false;
+				}
+				const uint8_t *match = op - offset;
+				if (offset >= matchBytes)
+				{
+					memcpy(op, match, matchBytes);
+				}
+				else
+				{
+					//overlapping match, repeats the last offset bytes
+					for (size_t i = 0; i < matchBytes; i++)
+					{
+						op[i] = match[i];
+					}
+				}
+				op += matchBytes;
+			}
+			return op == outputEnd;
+		}
+	};
+} // namespace dspar
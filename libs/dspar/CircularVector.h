@@ -20,6 +20,11 @@ namespace dspar
 
 		T Next()
 		{
+			if (currentIndex >= vector.size())
+			{
+				//items were removed behind the current one
+				currentIndex = 0;
+			}
 
 			T result = vector[currentIndex];
 
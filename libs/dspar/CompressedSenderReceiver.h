@@ -0,0 +1,246 @@
+#pragma once
+
+#include <map>
+#include <chrono>
+#include <vector>
+#include <ostream>
+#include "SenderReceiver.h"
+#include "BlockCodec.h"
+
+namespace dspar
+{
+	//Per-edge settings of CompressedSenderReceiver
+	struct CompressionSettings
+	{
+		//items whose serialized bytes are fewer than this are sent as they are
+		size_t threshold = 4096;
+		//1 (fastest) to 6, see BlockCodec::Compress
+		int level = 1;
+		//after sampleItems compressed items, an edge whose ratio (raw / compressed bytes) stays under
+		//minRatio sends the next skipItems items uncompressed, then samples again
+		double minRatio = 1.1;
+		size_t sampleItems = 16;
+		size_t skipItems = 1024;
+	};
+
+	//Traffic of one edge. Seconds are spent compressing on the sending side, decompressing on the receiving side.
+	struct CompressionStats
+	{
+		uint64_t items = 0;
+		uint64_t compressedItems = 0;
+		uint64_t rawBytes = 0;
+		uint64_t wireBytes = 0;
+		double seconds = 0;
+
+		double Ratio() const
+		{
+			return wireBytes > 0 ? (double)rawBytes / wireBytes : 1.0;
+		}
+	};
+
+	//Decorator compressing what another serializer sends. The inner serializer writes the item to a local
+	//buffer (MPISender::BeginCapture), which goes on the wire as one segmented item, compressed with BlockCodec
+	//when it is large enough and compresses well, and is replayed to the inner serializer on the receiving side.
+	//Both ends of an edge must use it. Settings and statistics are kept per edge (target or sender rank).
+	template <typename T>
+	class CompressedSenderReceiver : public SenderReceiver<T>
+	{
+	private:
+		static const uint32_t CODEC_NONE = 0;
+		static const uint32_t CODEC_BLOCK = 1;
+
+		struct Prefix
+		{
+			uint32_t codec;
+			uint32_t unused;
+			uint64_t rawBytes;
+			uint64_t wireBytes;
+		};
+
+		struct Edge
+		{
+			CompressionSettings settings;
+			CompressionStats stats;
+			//bytes of the items compressed since the last sample started
+			size_t sampledItems = 0;
+			uint64_t sampledRawBytes = 0;
+			uint64_t sampledWireBytes = 0;
+			//items left to send without trying to compress them
+			size_t skippedItems = 0;
+		};
+
+		SenderReceiver<T> &inner;
+		CompressionSettings defaultSettings;
+		std::map<int, Edge> sentEdges;
+		std::map<int, Edge> receivedEdges;
+		BlockCodec codec;
+		std::vector<char> rawBuffer;
+		std::vector<char> wireBuffer;
+
+		Edge &EdgeOf(std::map<int, Edge> &edges, int rank)
+		{
+			auto it = edges.find(rank);
+			if (it == edges.end())
+			{
+				it = edges.insert(std::make_pair(rank, Edge())).first;
+				it->second.settings = defaultSettings;
+			}
+			return it->second;
+		}
+
+		bool ShouldCompress(Edge &edge, size_t bytes)
+		{
+			if (bytes < edge.settings.threshold)
+			{
+				return false;
+			}
+			if (edge.skippedItems > 0)
+			{
+				edge.skippedItems--;
+				return false;
+			}
+			return true;
+		}
+
+		void Sample(Edge &edge, size_t rawBytes, size_t wireBytes)
+		{
+			edge.sampledItems++;
+			edge.sampledRawBytes += rawBytes;
+			edge.sampledWireBytes += wireBytes;
+			if (edge.sampledItems < edge.settings.sampleItems)
+			{
+				return;
+			}
+			if (edge.sampledRawBytes < edge.settings.minRatio * edge.sampledWireBytes)
+			{
+				edge.skippedItems = edge.settings.skipItems;
+			}
+			edge.sampledItems = 0;
+			edge.sampledRawBytes = 0;
+			edge.sampledWireBytes = 0;
+		}
+
+		static double SecondsSince(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		static void PrintEdges(std::ostream &out, const char *direction, std::map<int, Edge> &edges)
+		{
+			for (auto &entry : edges)
+			{
+				const CompressionStats &stats = entry.second.stats;
+				out << direction << " " << entry.first << ": " << stats.items << " items, " << stats.compressedItems << " compressed, "
+					<< stats.rawBytes << " -> " << stats.wireBytes << " bytes (ratio " << stats.Ratio() << "), "
+					<< stats.seconds << " s\n";
+			}
+		}
+
+	public:
+		CompressedSenderReceiver(SenderReceiver<T> &_inner, CompressionSettings settings = CompressionSettings())
+			: inner(_inner), defaultSettings(settings) {}
+
+		//Settings of the edge to target, the default ones for edges not set
+		void SetEdgeSettings(int target, CompressionSettings settings)
+		{
+			EdgeOf(sentEdges, target).settings = settings;
+		}
+
+		void OnStart() override
+		{
+			inner.Start();
+		}
+
+		void Send(MPISender &sender, MessageHeader &msg, T &data) override
+		{
+			rawBuffer.clear();
+			sender.BeginCapture(rawBuffer);
+			inner.Send(sender, msg, data);
+			sender.EndCapture();
+
+			Edge &edge = EdgeOf(sentEdges, msg.target);
+			Prefix prefix = {CODEC_NONE, 0, rawBuffer.size(), rawBuffer.size()};
+			BlockList segments;
+			if (ShouldCompress(edge, rawBuffer.size()))
+			{
+				auto start = std::chrono::steady_clock::now();
+				wireBuffer.resize(BlockCodec::MaxCompressedSize(rawBuffer.size()));
+				size_t compressedBytes = codec.Compress(rawBuffer.data(), rawBuffer.size(), wireBuffer.data(), edge.settings.level);
+				edge.stats.seconds += SecondsSince(start);
+				Sample(edge, rawBuffer.size(), compressedBytes);
+				if (compressedBytes < rawBuffer.size())
+				{
+					prefix.codec = CODEC_BLOCK;
+					prefix.wireBytes = compressedBytes;
+					segments.Add(wireBuffer.data(), compressedBytes);
+					edge.stats.compressedItems++;
+				}
+			}
+			if (prefix.codec == CODEC_NONE)
+			{
+				segments.Add(rawBuffer.data(), rawBuffer.size());
+			}
+			edge.stats.items++;
+			edge.stats.rawBytes += prefix.rawBytes;
+			edge.stats.wireBytes += prefix.wireBytes;
+			sender.SendSegments(msg, &prefix, sizeof(Prefix), segments);
+		}
+
+		T Receive(MPIReceiver &receiver, MessageHeader &msg) override
+		{
+			Prefix prefix;
+			receiver.ReceiveSegmentPrefix(msg, &prefix, sizeof(Prefix));
+			std::vector<char> &wire = prefix.codec == CODEC_NONE ? rawBuffer : wireBuffer;
+			wire.resize(prefix.wireBytes);
+			BlockList segments;
+			segments.Add(wire.data(), wire.size());
+			receiver.ReceiveSegments(msg, segments);
+
+			Edge &edge = EdgeOf(receivedEdges, msg.sender);
+			if (prefix.codec != CODEC_NONE)
+			{
+				auto start = std::chrono::steady_clock::now();
+				rawBuffer.resize(prefix.rawBytes);
+				if (prefix.codec != CODEC_BLOCK || !BlockCodec::Decompress(wireBuffer.data(), wireBuffer.size(), rawBuffer.data(), rawBuffer.size()))
+				{
+					SERDE_ERROR("Corrupt compressed item from " << msg.sender << ", codec " << prefix.codec << ". Aborting to prevent errors");
+					MPI_Abort(receiver.GetComm(), 1);
+				}
+				edge.stats.seconds += SecondsSince(start);
+				edge.stats.compressedItems++;
+			}
+			edge.stats.items++;
+			edge.stats.rawBytes += prefix.rawBytes;
+			edge.stats.wireBytes += prefix.wireBytes;
+
+			MessageHeader replay = receiver.BeginReplay(msg, rawBuffer.data(), rawBuffer.size());
+			T data = inner.Receive(receiver, replay);
+			if (!receiver.EndReplay())
+			{
+				SERDE_ERROR("Compressed item from " << msg.sender << " was not fully read by its serializer. Aborting to prevent errors");
+				MPI_Abort(receiver.GetComm(), 1);
+			}
+			return data;
+		}
+
+		//Statistics of the edge to target or from sender, empty when nothing went through it
+		CompressionStats SentStats(int target)
+		{
+			auto it = sentEdges.find(target);
+			return it == sentEdges.end() ? CompressionStats() : it->second.stats;
+		}
+
+		CompressionStats ReceivedStats(int sender)
+		{
+			auto it = receivedEdges.find(sender);
+			return it == receivedEdges.end() ? CompressionStats() : it->second.stats;
+		}
+
+		//One line per edge this rank sent or received items on
+		void PrintStats(std::ostream &out)
+		{
+			PrintEdges(out, "to", sentEdges);
+			PrintEdges(out, "from", receivedEdges);
+		}
+	};
+} // namespace dspar
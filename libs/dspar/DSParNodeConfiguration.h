@@ -6,12 +6,63 @@ namespace dspar
         bool AskForDemandUpstream;
         bool WaitForDemandDownstream;
         bool Ordered;
+        //Pack the header and all parts of an emitted item into one MPI message
+        bool SingleBufferFraming;
+        //Without single buffer framing, payloads up to this size still go inline with the header, 0 disables it
+        int EagerPayloadBytes;
+        //Items emitted with MPI_Isend that may be pending per target, 0 for blocking sends
+        int MaxInFlightSendsPerTarget;
+        //Header receives kept posted ahead of the item being processed, 0 disables prefetching
+        int PrefetchDepth;
+        //Also post the payload receive of prefetched items sent as header plus packed tail
+        bool PrefetchPayloads;
+        //Items a source packs in one message, 1 disables batching
+        int BatchSize;
+        //A source batch is sent once its first item is older than this, 0 waits for BatchSize items
+        long BatchTimeoutMicroseconds;
+        //Messages an on-demand worker may have outstanding, it returns credits in bulk as they are processed
+        int DemandCredits;
+        //Processed messages acknowledged by one credit update, 0 uses half of DemandCredits
+        int CreditUpdateInterval;
+        //Credits held longer than this are returned on the next processed message, 0 disables the timer
+        long CreditUpdateTimeoutMicroseconds;
+        //Send demand signals with MPI_Isend and go straight back to receiving
+        bool AsyncDemand;
+        //Queue received messages locally and take queued messages of other workers when idle (see SetStealPeers)
+        bool WorkStealing;
+        //Report the service rate (items per second of processing) upstream every RateReportIntervalMicroseconds
+        bool ReportServiceRateUpstream;
+        long RateReportIntervalMicroseconds;
+        //Send to each target in proportion to the service rate it reports, with smooth weighted round robin
+        bool WeightByServiceRateDownstream;
+        //Send to the less loaded of two random targets, their load estimated from the reported service rates
+        bool JoinShortestQueueDownstream;
 
         DSParNodeConfiguration()
         {
             AskForDemandUpstream = false;
             WaitForDemandDownstream = false;
             Ordered = false;
+            SingleBufferFraming = false;
+            EagerPayloadBytes = DSPAR_EAGER_PAYLOAD_THRESHOLD;
+            MaxInFlightSendsPerTarget = 0;
+            PrefetchDepth = 0;
+            PrefetchPayloads = true;
+            BatchSize = 1;
+            BatchTimeoutMicroseconds = 0;
+            DemandCredits = 1;
+            CreditUpdateInterval = 0;
+            CreditUpdateTimeoutMicroseconds = 0;
+            WorkStealing = false;
+            ReportServiceRateUpstream = false;
+            RateReportIntervalMicroseconds = 100000;
+            WeightByServiceRateDownstream = false;
+            JoinShortestQueueDownstream = false;
+#ifdef ASYNC_DEMAND
+            AsyncDemand = true;
+#else
+            AsyncDemand = false;
+#endif
         }
     };
 } // namespace dspar
\ No newline at end of file
@@ -2,14 +2,23 @@
 
 #include "dspar.h"
 #include <functional>
+#include <memory>
 namespace dspar
 {
 
-    std::vector<std::function<void()>> afterProcessMessageHandlers;
+    //per thread, nodes may run as threads of one process (see StartInThreads)
+    thread_local std::vector<std::function<void()>> afterProcessMessageHandlers;
     void DeferAfterProcessMessage(std::function<void()> functionToRun) {
         afterProcessMessageHandlers.push_back(functionToRun);
     }
 
+    void RunAfterProcessMessageHandlers() {
+        for (int i = afterProcessMessageHandlers.size() - 1; i >= 0; i--) {
+            afterProcessMessageHandlers[i]();
+        }
+        afterProcessMessageHandlers.clear();
+    }
+
 
     enum AfterStart
     {
@@ -50,13 +59,35 @@ namespace dspar
         {
             LOG_DEBUG("StartNode called");
             TRACE();
-            MPISender sender(_comm);
-            MPIReceiver receiver(_comm);
+            //nodes started in threads already have their transport, the others talk MPI
+            std::unique_ptr<MPITransport> mpiTransport;
+            if (CurrentTransport() == NULL)
+            {
+                mpiTransport.reset(new MPITransport(_comm));
+            }
+            Transport &transport = mpiTransport ? *mpiTransport : *CurrentTransport();
+            MPISender sender(_comm, transport);
+            MPIReceiver receiver(_comm, transport);
 
             this->comm = &_comm;
             this->Sender = &sender;
             this->Receiver = &receiver;
 
+            //collective, every rank of the graph builds its rings here
+            std::unique_ptr<StreamChannels> channels;
+            if (mpiTransport && globals::rmaRingBytes > 0)
+            {
+                channels.reset(new RMAChannels(_comm, GetSourceRanks(), globals::rmaRingBytes));
+            }
+            else if (mpiTransport && globals::sharedMemoryRingBytes > 0)
+            {
+                channels.reset(new SharedMemoryChannels(_comm, GetSourceRanks(), globals::sharedMemoryRingBytes));
+            }
+            if (channels)
+            {
+                transport.SetStreamChannels(channels.get());
+            }
+
             AfterStart behavior = OnStart();
 
             int rank = mpiUtils.GetMyRank(_comm);
@@ -69,6 +100,13 @@ namespace dspar
 #ifdef DSPARTIMINGS
                     this->currentMessageStartRecv = Clock::now();
 #endif
+                    sender.ReapCompletedSends();
+                    BeforeReceivingMessage();
+                    if (HasFinished())
+                    {
+                        break;
+                    }
+
                     MessageHeader msg;
                     {
                         TRBLOCK("Waiting for message header...");
@@ -88,17 +126,19 @@ namespace dspar
                     {
                         TRBLOCK("Calling OnReceiveMessage");
                         OnReceiveMessage(msg);
-
-                        for (int i = afterProcessMessageHandlers.size() - 1; i >= 0; i--) {
-                            afterProcessMessageHandlers[i]();
-                        }
-                        afterProcessMessageHandlers.clear();
+                        RunAfterProcessMessageHandlers();
                     }
                 }
             }
+            receiver.StopPrefetching();
             DSPAR_DEBUG("Stopping node " << rank);
 
             OnStop();
+            sender.WaitForPendingSends();
+            if (channels)
+            {
+                channels->Free();
+            }
             DSPAR_DEBUG("STOPPED node " << rank);
         }
 
@@ -107,14 +147,14 @@ namespace dspar
             return GetReceiver().StartReceivingDemand();
         }
 
-        DemandSignal SendDemand(int target, int demand)
+        DemandSignal SendDemand(int target, int demand, int acked = 0)
         {
-            return GetSender().SendDemandSignalTo(target, demand);
+            return GetSender().SendDemandSignalTo(target, demand, acked);
         }
 
-        AsyncMPIRequest<DemandSignal> SendDemandAsync(int target, int demand)
+        AsyncMPIRequest<DemandSignal> SendDemandAsync(int target, int demand, int acked = 0)
         {
-            return GetSender().SendDemandSignalToAsync(target, demand);
+            return GetSender().SendDemandSignalToAsync(target, demand, acked);
         }
 
         template <typename T>
@@ -127,6 +167,18 @@ namespace dspar
         {
             return AfterStart::ReceiveMessages;
         }
+        //Ranks this node receives stream messages from
+        virtual std::vector<int> GetSourceRanks()
+        {
+            return std::vector<int>();
+        }
+        //Called before each blocking wait for the next message
+        virtual void BeforeReceivingMessage() {}
+        //Checked before each wait, true leaves the message loop without waiting for a stop message
+        virtual bool HasFinished()
+        {
+            return false;
+        }
         virtual void OnStop() = 0;
         virtual StopResponse OnReceiveStop(MessageHeader &msg) = 0;
         virtual void OnReceiveMessage(MessageHeader &msg) = 0;
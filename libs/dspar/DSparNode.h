@@ -7,23 +7,34 @@
 #include <algorithm>
 #include "dspar.h"
 #include <map>
+#include <deque>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "wrappers.h"
 #include "SenderReceiver.h"
+#include "CompressedSenderReceiver.h"
+#include "StructSenderReceiver.h"
+#include "KeyRouter.h"
+#include "ReorderBuffer.h"
 #include "Pipeline.h"
 
 namespace dspar
 {
+	//One stream item of a batch. The wrapper keeps std::vector<bool> specialization out of batches.
+	template <typename T>
+	struct BatchItem
+	{
+		T value;
+	};
+
 	template <typename T>
 	struct MessageToReorder
 	{
-		MessageToReorder(MessageHeader _header, T _data) : header(_header), data(_data){};
+		MessageToReorder(MessageHeader _header, std::vector<BatchItem<T>> _data) : header(_header), data(std::move(_data)){};
 		MessageHeader header;
-		T data;
-
-		bool operator<(const MessageToReorder &m) const
-		{
-			return m.header.id < header.id;
-		}
+		std::vector<BatchItem<T>> data;
 	};
 
 	template <typename StageInput, typename StageOutput>
@@ -39,28 +50,116 @@ namespace dspar
 		DSParNodeConfiguration nodeConfiguration;
 		dspar::CircularVector<int> nextStageRanks;
 		dspar::CircularVector<int> sources;
-		std::priority_queue<MessageToReorder<StageInput>> orderedMessages;
+		//ordered node: messages that arrived before currentMessage, and those released for it
+		ReorderBuffer<MessageToReorder<StageInput>> orderedMessages;
+		std::vector<MessageToReorder<StageInput>> releasedMessages;
 		uint64_t currentMessage = 0;
 
 		MessageHeader latestMessageHeader;
 		bool emitShouldUseLatestHeader = false;
 		AfterStart afterStart;
 
+		//items waiting to be sent together in one message
+		std::vector<BatchItem<StageOutput>> outputBatch;
+		std::chrono::steady_clock::time_point outputBatchStart;
+		//a source's partial batch is sent by batchTimer once it expires, even while Produce blocks
+		std::mutex outputBatchMutex;
+		std::condition_variable batchTimerWake;
+		std::thread batchTimer;
+		bool batchTimerStop = false;
+		//true while processing an input message whose outputs are sent as one batch
+		bool groupOutputsOfMessage = false;
+
+		//on-demand emitter: credits each worker rank advertised and we did not use yet
+		std::map<int, int> workerCredits;
+		int lastCreditTarget = -1;
+		//on-demand worker: credits of processed messages not yet returned upstream
+		int creditsToReturn = 0;
+		std::chrono::steady_clock::time_point creditsHeldSince;
+
+		//work stealing: the other workers, those that may still have work, and messages received but not processed
+		std::vector<int> stealPeers;
+		dspar::CircularVector<int> stealVictims;
+		std::deque<MessageToReorder<StageInput>> localQueue;
+		bool stealPending = false;
+		//messages peers said they sent us and those that arrived
+		int stolenMessagesExpected = 0;
+		int stolenMessagesReceived = 0;
+		bool sourcesStopped = false;
+		bool farewellSent = false;
+		size_t farewellsReceived = 0;
+		//after a round of empty replies, the next request waits a bit longer
+		size_t failedSteals = 0;
+		long stealBackoffMicroseconds = 0;
+		std::chrono::steady_clock::time_point nextStealAttempt;
+
+		//weighted or join-shortest-queue emitter: targets, their smoothed service rates (0 until reported)
+		//and smooth weighted round robin counters
+		std::vector<int> reportingTargets;
+		std::vector<double> targetRates;
+		std::vector<double> targetCounters;
+		size_t finalRateReports = 0;
+		//join-shortest-queue emitter: items sent to each target, and at its last report the items it had received,
+		//those it had not finished, the seconds it had been processing the first of them and when it arrived
+		std::vector<uint64_t> targetSentItems;
+		std::vector<uint64_t> targetReceivedItems;
+		std::vector<int> targetQueuedItems;
+		std::vector<double> targetElapsedSeconds;
+		std::vector<std::chrono::steady_clock::time_point> targetReportTimes;
+		std::minstd_rand targetSampler;
+		//rate-reporting worker: items and processing time since the last report, items received so far, those
+		//of the current message not finished yet and when the one running started, and what the last report said
+		int itemsSinceReport = 0;
+		double busySecondsSinceReport = 0;
+		std::chrono::steady_clock::time_point lastRateReport;
+		uint64_t itemsReceived = 0;
+		int itemsLeftInMessage = 0;
+		std::chrono::steady_clock::time_point currentItemStart;
+		uint64_t reportedReceived = 0;
+		int reportedQueued = 0;
+		//while an item runs, rateReporter reports changes of the backlog; rateReportMutex guards the fields above
+		std::mutex rateReportMutex;
+		std::condition_variable rateReporterWake;
+		std::thread rateReporter;
+		bool rateReporterStop = false;
+
+		//key routing: hash of the key of an output item, and the target each hash goes to
+		std::function<size_t(StageOutput &)> routingKey;
+		bool consistentHashing = false;
+		std::unique_ptr<KeyRouter> keyRouter;
+
 		int processCalls = 0;
 		//int emitCalls = 0;
 		//int onReceiveBeforeRecv = 0;
 		//int onReceiveAfterRecv = 0;
 
 	private:
-		void WaitDemandAndEmit(StageOutput &data, MessageHeader &previousHeader)
+		//Sends the items of the message started with header and completes it
+		void SendItems(MessageHeader &header, BatchItem<StageOutput> *items, uint32_t count)
+		{
+			if (this->GetSender().MovesObjects())
+			{
+				//in-process transport: the next stage takes the items themselves, nothing is serialized
+				auto batch = std::make_shared<std::vector<BatchItem<StageOutput>>>(std::make_move_iterator(items), std::make_move_iterator(items + count));
+				this->GetSender().SendObject(header, batch);
+			}
+			else
+			{
+				for (uint32_t i = 0; i < count; i++)
+				{
+					outputSender.Send(this->GetSender(), header, items[i].value);
+				}
+			}
+			this->GetSender().FinishSendingMessage(header);
+		}
+
+		void WaitDemandAndEmit(BatchItem<StageOutput> *items, uint32_t count, MessageHeader &previousHeader)
 		{
 			TRACE();
 			TRLABEL("FarmStage: Waiting for demand...");
-			DemandSignal demand = this->WaitForDemand();
+			int targetRank = AcquireCredit();
 			TRLABEL("FarmStage: Emitting");
 
-			int targetRank = demand.sender;
-
 #ifdef DSPARTIMINGS
 			Duration d(previousHeader.ts);
 			TimePoint tp(d);
@@ -80,23 +179,21 @@ namespace dspar
 				.totalComputeTime = totalComputeTime.count(),
 			};
 
-			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, previousHeader.id, previousHeader.ts, timings);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, previousHeader.id, previousHeader.ts, timings, count);
 #else
-			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, previousHeader.id);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, previousHeader.id, count);
 #endif
 
 			TRLABEL("FarmStage outputSender.Send(this->GetSender(), header, data);");
-			outputSender.Send(this->GetSender(), header, data);
+			SendItems(header, items, count);
 		};
 
-		void WaitDemandAndEmit(StageOutput &data)
+		void WaitDemandAndEmit(BatchItem<StageOutput> *items, uint32_t count)
 		{
 			TRACE();
 			TRLABEL("FarmStage: Waiting for demand...");
-			DemandSignal demand = this->WaitForDemand();
+			int targetRank = AcquireCredit();
 			TRLABEL("FarmStage: Emitting");
-
-			int targetRank = demand.sender;
 #ifdef DSPARTIMINGS
 			Duration thisMsgComputeTime = this->currentMessageEndComputing - this->currentMessageStartComputing;
 			auto timings = Timings{
@@ -104,15 +201,15 @@ namespace dspar
 				//.totalIoTime = 0,
 				.totalComputeTime = thisMsgComputeTime.count(),
 			};
-			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, std::numeric_limits<uint64_t>::max(), 0, timings);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, std::numeric_limits<uint64_t>::max(), 0, timings, count);
 #else
-			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, std::numeric_limits<uint64_t>::max());
+			MessageHeader header = this->GetSender().StartSendingMessageTo(targetRank, std::numeric_limits<uint64_t>::max(), count);
 #endif
 			TRLABEL("FarmStage outputSender.Send(this->GetSender(), header, data);");
-			outputSender.Send(this->GetSender(), header, data);
+			SendItems(header, items, count);
 		};
 
-		void EmitRoundRobin(StageOutput &data, MessageHeader &previousHeader)
+		void EmitRoundRobin(BatchItem<StageOutput> *items, uint32_t count, MessageHeader &previousHeader)
 		{
 			TRACE();
 			TRLABEL("FarmStage: Emitting");
@@ -138,15 +235,15 @@ namespace dspar
 				.totalComputeTime = totalComputeTime.count(),
 			};
 
-			MessageHeader header = this->GetSender().StartSendingMessageTo(nextStageRanks.Next(), previousHeader.id, previousHeader.ts, timings);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(NextTarget(items, count), previousHeader.id, previousHeader.ts, timings, count);
 #else
-			MessageHeader header = this->GetSender().StartSendingMessageTo(nextStageRanks.Next(), previousHeader.id);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(NextTarget(items, count), previousHeader.id, count);
 #endif
 			TRLABEL("FarmStage outputSender.Send(this->GetSender(), header, data);");
-			outputSender.Send(this->GetSender(), header, data);
+			SendItems(header, items, count);
 		};
 
-		void EmitRoundRobin(StageOutput &data)
+		void EmitRoundRobin(BatchItem<StageOutput> *items, uint32_t count)
 		{
 			TRACE();
 			TRLABEL("FarmStage: Emitting");
@@ -158,54 +255,468 @@ namespace dspar
 				//.totalIoTime = 0,
 				.totalComputeTime = thisMsgComputeTime.count(),
 			};
-			MessageHeader header = this->GetSender().StartSendingMessageTo(nextStageRanks.Next(),
-																		   std::numeric_limits<uint64_t>::max(), 0, timings);
+			MessageHeader header = this->GetSender().StartSendingMessageTo(NextTarget(items, count),
+																		   std::numeric_limits<uint64_t>::max(), 0, timings, count);
 #else
-			MessageHeader header = this->GetSender().StartSendingMessageTo(nextStageRanks.Next(), std::numeric_limits<uint64_t>::max());
+			MessageHeader header = this->GetSender().StartSendingMessageTo(NextTarget(items, count), std::numeric_limits<uint64_t>::max(), count);
 
 #endif
 			TRLABEL("FarmStage outputSender.Send(this->GetSender(), header, data);");
-			outputSender.Send(this->GetSender(), header, data);
+			SendItems(header, items, count);
 		};
 
-		void Emit(StageOutput &data, MessageHeader &previousHeader)
+		void ReceiveRateReports()
+		{
+			DemandSignal report;
+			while (this->GetReceiver().TryReceivingDemand(report))
+			{
+				AddRateReport(report);
+			}
+		}
+
+		void AddRateReport(DemandSignal &report)
+		{
+			auto it = std::find(reportingTargets.begin(), reportingTargets.end(), report.sender);
+			if (report.kind != RATE_REPORT || it == reportingTargets.end())
+			{
+				return;
+			}
+			size_t index = it - reportingTargets.begin();
+			targetReceivedItems[index] = report.received;
+			targetQueuedItems[index] = report.queued;
+			targetElapsedSeconds[index] = report.elapsed;
+			targetReportTimes[index] = std::chrono::steady_clock::now();
+			if (report.rate > 0)
+			{
+				//recent reports count most, so a worker that slows down loses its share within a few intervals
+				double &rate = targetRates[index];
+				rate = rate > 0 ? (rate + report.rate) / 2 : report.rate;
+				dspar::globals::workerWeights[report.sender] = rate;
+			}
+			if (report.acked)
+			{
+				finalRateReports++;
+			}
+		}
+
+		//Smooth weighted round robin over the reported service rates. Targets not reported yet weigh the
+		//average, and every target keeps a small share so the rate of a slowed down worker is still measured.
+		int NextWeightedTarget()
+		{
+			ReceiveRateReports();
+
+			double reportedSum = 0, largest = 0;
+			size_t reported = 0;
+			for (double rate : targetRates)
+			{
+				if (rate > 0)
+				{
+					reportedSum += rate;
+					largest = std::max(largest, rate);
+					reported++;
+				}
+			}
+			double unreported = reported > 0 ? reportedSum / reported : 1.0;
+			double floor = std::max(largest, unreported) / 20;
+
+			double total = 0;
+			size_t best = 0;
+			for (size_t i = 0; i < reportingTargets.size(); i++)
+			{
+				double weight = std::max(targetRates[i] > 0 ? targetRates[i] : unreported, floor);
+				targetCounters[i] += weight;
+				total += weight;
+				if (targetCounters[i] > targetCounters[best])
+				{
+					best = i;
+				}
+			}
+			targetCounters[best] -= total;
+			return reportingTargets[best];
+		}
+
+		//Seconds of work a target has left: the items it had not received at its last report plus those it had
+		//queued, at its mean service time (the average one until it reports), less the time the first of them
+		//has been running (the elapsed time it reported, and the time since the report)
+		double EstimatedBacklog(size_t index, double averageServiceSeconds, std::chrono::steady_clock::time_point now)
+		{
+			uint64_t outstanding = targetSentItems[index] - targetReceivedItems[index] + targetQueuedItems[index];
+			if (outstanding == 0)
+			{
+				return 0;
+			}
+			double serviceSeconds = targetRates[index] > 0 ? 1 / targetRates[index] : averageServiceSeconds;
+			double running = targetElapsedSeconds[index] + std::chrono::duration<double>(now - targetReportTimes[index]).count();
+			return outstanding * serviceSeconds - std::min(running, serviceSeconds);
+		}
+
+		//Join the shortest queue with power of two choices: the less loaded of two random targets gets the items
+		int NextShortestQueueTarget(uint32_t count)
+		{
+			ReceiveRateReports();
+
+			double rateSum = 0;
+			size_t reported = 0;
+			for (double rate : targetRates)
+			{
+				if (rate > 0)
+				{
+					rateSum += rate;
+					reported++;
+				}
+			}
+			double averageServiceSeconds = reported > 0 ? reported / rateSum : 1.0;
+
+			size_t targets = reportingTargets.size();
+			size_t first = targetSampler() % targets;
+			size_t chosen = first;
+			if (targets > 1)
+			{
+				size_t second = (first + 1 + targetSampler() % (targets - 1)) % targets;
+				auto now = std::chrono::steady_clock::now();
+				double firstBacklog = EstimatedBacklog(first, averageServiceSeconds, now);
+				double secondBacklog = EstimatedBacklog(second, averageServiceSeconds, now);
+				if (secondBacklog < firstBacklog)
+				{
+					chosen = second;
+				}
+			}
+			targetSentItems[chosen] += count;
+			return reportingTargets[chosen];
+		}
+
+		//Target of a message, the one of its first item's key with key routing
+		int NextTarget(BatchItem<StageOutput> *items, uint32_t count)
+		{
+			if (keyRouter)
+			{
+				return keyRouter->Route(routingKey(items[0].value));
+			}
+			if (nodeConfiguration.JoinShortestQueueDownstream)
+			{
+				return NextShortestQueueTarget(count);
+			}
+			return nodeConfiguration.WeightByServiceRateDownstream ? NextWeightedTarget() : nextStageRanks.Next();
+		}
+
+		//With key routing, the items of a batch may go to several targets. Returns false when they all go
+		//to the same one, otherwise moves each run of consecutive items with the same target into a group,
+		//so messages sent in turn keep the items in order.
+		bool SplitByKey(BatchItem<StageOutput> *items, uint32_t count, std::vector<std::vector<BatchItem<StageOutput>>> &groups)
+		{
+			if (!keyRouter || count < 2)
+			{
+				return false;
+			}
+			std::vector<int> itemTargets(count);
+			bool sameTarget = true;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				itemTargets[i] = keyRouter->Route(routingKey(items[i].value));
+				sameTarget = sameTarget && itemTargets[i] == itemTargets[0];
+			}
+			if (sameTarget)
+			{
+				return false;
+			}
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (i == 0 || itemTargets[i] != itemTargets[i - 1])
+				{
+					groups.emplace_back();
+				}
+				groups.back().push_back(std::move(items[i]));
+			}
+			return true;
+		}
+
+		//The last report of each target follows the stop message, so none is left unreceived
+		void WaitFinalRateReports()
+		{
+			while (finalRateReports < reportingTargets.size())
+			{
+				DemandSignal report = this->WaitForDemand();
+				AddRateReport(report);
+			}
+		}
+
+		//Called with rateReportMutex held while rateReporter runs
+		void ReportServiceRate(int target, bool last)
+		{
+			auto now = std::chrono::steady_clock::now();
+			DemandSignal report = DemandSignal();
+			report.amount = itemsSinceReport;
+			report.rate = busySecondsSinceReport > 0 ? itemsSinceReport / busySecondsSinceReport : 0;
+			report.received = itemsReceived;
+			report.queued = itemsLeftInMessage;
+			report.elapsed = itemsLeftInMessage > 0 ? std::chrono::duration<double>(now - currentItemStart).count() : 0;
+			this->GetSender().SendRateReportTo(target, report, last);
+			itemsSinceReport = 0;
+			busySecondsSinceReport = 0;
+			lastRateReport = now;
+			reportedReceived = itemsReceived;
+			reportedQueued = itemsLeftInMessage;
+		}
+
+		//Items end up reported when their message is processed, so a long running item would leave the emitter
+		//with the backlog of the previous report. While an item runs, this thread reports the messages received
+		//and items finished since, at most once per interval. MPI must allow sends from a second thread.
+		void StartRateReporter()
+		{
+			rateReporterStop = false;
+			rateReporter = std::thread([this]() {
+				std::unique_lock<std::mutex> lock(rateReportMutex);
+				auto interval = std::chrono::microseconds(nodeConfiguration.RateReportIntervalMicroseconds);
+				while (!rateReporterStop)
+				{
+					auto now = std::chrono::steady_clock::now();
+					bool changed = itemsLeftInMessage > 0 && (itemsReceived != reportedReceived || itemsLeftInMessage != reportedQueued);
+					if (changed && now - lastRateReport >= interval)
+					{
+						ReportServiceRate(sources.Next(), false);
+						continue;
+					}
+					rateReporterWake.wait_until(lock, (changed ? lastRateReport : now) + interval);
+				}
+			});
+		}
+
+		void StopRateReporter()
+		{
+			if (!rateReporter.joinable())
+			{
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(rateReportMutex);
+				rateReporterStop = true;
+			}
+			rateReporterWake.notify_one();
+			rateReporter.join();
+		}
+
+		void Emit(BatchItem<StageOutput> *items, uint32_t count, MessageHeader &previousHeader)
 		{
+			std::vector<std::vector<BatchItem<StageOutput>>> groups;
+			if (SplitByKey(items, count, groups))
+			{
+				//each group keeps the id of the input message, see FarmPattern::SetKeyRouting
+				for (auto &group : groups)
+				{
+					EmitRoundRobin(group.data(), (uint32_t)group.size(), previousHeader);
+				}
+				return;
+			}
 			if (nodeConfiguration.WaitForDemandDownstream)
 			{
-				WaitDemandAndEmit(data, previousHeader);
+				WaitDemandAndEmit(items, count, previousHeader);
 			}
 			else
 			{
-				EmitRoundRobin(data, previousHeader);
+				EmitRoundRobin(items, count, previousHeader);
 			}
 		};
 
-		void Emit(StageOutput &data)
+		void Emit(BatchItem<StageOutput> *items, uint32_t count)
 		{
+			std::vector<std::vector<BatchItem<StageOutput>>> groups;
+			if (SplitByKey(items, count, groups))
+			{
+				for (auto &group : groups)
+				{
+					EmitRoundRobin(group.data(), (uint32_t)group.size());
+				}
+				return;
+			}
 			if (nodeConfiguration.WaitForDemandDownstream)
 			{
-				WaitDemandAndEmit(data);
+				WaitDemandAndEmit(items, count);
 			}
 			else
 			{
-				EmitRoundRobin(data);
+				EmitRoundRobin(items, count);
 			}
 		};
 
-		void WaitFinalDemands()
+		//Sends the items emitted by a source since the batch started (no input header to follow)
+		void FlushOutputBatch()
 		{
-			TRACE();
-			TRLABEL("FarmStage Wait Final Demands");
+			if (outputBatch.empty())
+			{
+				return;
+			}
+			Emit(outputBatch.data(), (uint32_t)outputBatch.size());
+			outputBatch.clear();
+		}
+
+		//Sends the items emitted while processing the input message described by header, reusing its id
+		void FlushOutputBatch(MessageHeader &header)
+		{
+			if (outputBatch.empty())
+			{
+				return;
+			}
+			Emit(outputBatch.data(), (uint32_t)outputBatch.size(), header);
+			outputBatch.clear();
+		}
+
+		//Sends the batch of a source once it is BatchTimeoutMicroseconds old, whether or not Produce emits again.
+		//Emits and flushes are serialized by outputBatchMutex, MPI must allow sends from a second thread.
+		void StartBatchTimer()
+		{
+			batchTimerStop = false;
+			batchTimer = std::thread([this]() {
+				std::unique_lock<std::mutex> lock(outputBatchMutex);
+				auto timeout = std::chrono::microseconds(nodeConfiguration.BatchTimeoutMicroseconds);
+				while (!batchTimerStop)
+				{
+					if (outputBatch.empty())
+					{
+						batchTimerWake.wait(lock);
+					}
+					else if (BatchTimeoutExpired())
+					{
+						FlushOutputBatch();
+					}
+					else
+					{
+						batchTimerWake.wait_until(lock, outputBatchStart + timeout);
+					}
+				}
+			});
+		}
+
+		void StopBatchTimer()
+		{
+			if (!batchTimer.joinable())
+			{
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(outputBatchMutex);
+				batchTimerStop = true;
+			}
+			batchTimerWake.notify_one();
+			batchTimer.join();
+		}
+
+		bool BatchTimeoutExpired()
+		{
+			if (nodeConfiguration.BatchTimeoutMicroseconds <= 0)
+			{
+				return false;
+			}
+			auto elapsed = std::chrono::steady_clock::now() - outputBatchStart;
+			return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() >= nodeConfiguration.BatchTimeoutMicroseconds;
+		}
+
+		void AddCredits(DemandSignal &demand)
+		{
+			//without coalescing, each acknowledged message and the first advertisement would be one signal
+			uint64_t signalsReplaced = demand.acked > 0 ? demand.acked : 1;
+			dspar::globals::demandSignalsReceived++;
+			dspar::globals::controlMessagesSaved += signalsReplaced - 1;
+			workerCredits[demand.sender] += demand.amount;
+		}
+
+		//Picks the worker with most credits left (the least loaded), ties broken round robin.
+		//Blocks for a demand signal only when no worker has credits.
+		int AcquireCredit()
+		{
+			DemandSignal demand;
+			while (this->GetReceiver().TryReceivingDemand(demand))
+			{
+				AddCredits(demand);
+			}
+
 			while (true)
 			{
-				DemandSignal demand = this->WaitForDemand();
-				DSPAR_DEBUG("Got final demand from " << demand.sender << ", numberOfSourcesWaitingToStop = " << nextStageRanks.Count());
+				int targetRank = -1;
+				int mostCredits = 0;
+				auto it = workerCredits.upper_bound(lastCreditTarget);
+				for (size_t i = 0; i < workerCredits.size(); i++, it++)
+				{
+					if (it == workerCredits.end())
+					{
+						it = workerCredits.begin();
+					}
+					if (it->second > mostCredits)
+					{
+						mostCredits = it->second;
+						targetRank = it->first;
+					}
+				}
+
+				if (targetRank >= 0)
+				{
+					workerCredits[targetRank]--;
+					lastCreditTarget = targetRank;
+					return targetRank;
+				}
+
+				demand = this->WaitForDemand();
+				AddCredits(demand);
+			}
+		}
+
+		void SendCredits(int target, int amount, int acked)
+		{
+			if (!nodeConfiguration.AsyncDemand)
+			{
+				this->SendDemand(target, amount, acked);
+				return;
+			}
+			//the sender keeps the request until it completes
+			this->SendDemandAsync(target, amount, acked);
+		}
+
+		//Returns the credits of processed messages upstream, acknowledging them in one signal
+		void ReturnCredits(int target)
+		{
+			if (creditsToReturn > 0)
+			{
+				SendCredits(target, creditsToReturn, creditsToReturn);
+				creditsToReturn = 0;
+			}
+		}
 
-				GetSender().SendStopMessageTo(demand.sender);
+		bool CreditTimeoutExpired()
+		{
+			if (nodeConfiguration.CreditUpdateTimeoutMicroseconds <= 0)
+			{
+				return false;
+			}
+			auto elapsed = std::chrono::steady_clock::now() - creditsHeldSince;
+			return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() >= nodeConfiguration.CreditUpdateTimeoutMicroseconds;
+		}
+
+		bool CreditUpdateDue()
+		{
+			int interval = nodeConfiguration.CreditUpdateInterval > 0 ? nodeConfiguration.CreditUpdateInterval : (nodeConfiguration.DemandCredits + 1) / 2;
+			return creditsToReturn >= std::min(interval, nodeConfiguration.DemandCredits) || CreditTimeoutExpired();
+		}
 
-				//DSPAR_DEBUG("Sent final demand stop signal to " << demand.sender);
+		//The stop message follows the items sent to each worker, which returns its held credits when it gets it.
+		//We wait until every credit is back, so no demand signal is left unreceived.
+		void WaitFinalDemands()
+		{
+			TRACE();
+			TRLABEL("FarmStage Wait Final Demands");
+			for (int rank : nextStageRanks.Data())
+			{
+				GetSender().SendStopMessageTo(rank);
+			}
 
-				nextStageRanks.Remove(demand.sender);
+			while (true)
+			{
+				for (int rank : nextStageRanks.Data())
+				{
+					if (workerCredits[rank] >= nodeConfiguration.DemandCredits)
+					{
+						DSPAR_DEBUG("Got final demand from " << rank << ", numberOfSourcesWaitingToStop = " << nextStageRanks.Count());
+						nextStageRanks.Remove(rank);
+					}
+				}
 
 				if (nextStageRanks.IsEmpty())
 				{
@@ -213,9 +724,204 @@ namespace dspar
 					return;
 				}
 				DSPAR_DEBUG("Awaiting more final demands");
+
+				DemandSignal demand = this->WaitForDemand();
+				AddCredits(demand);
 			}
 		};
 
+		std::vector<BatchItem<StageInput>> ReceiveItems(MessageHeader &msg)
+		{
+			std::vector<BatchItem<StageInput>> items;
+			if (this->GetReceiver().MovesObjects())
+			{
+				auto batch = std::static_pointer_cast<std::vector<BatchItem<StageInput>>>(this->GetReceiver().ReceiveObject(msg));
+				items = std::move(*batch);
+			}
+			else
+			{
+				uint32_t count = msg.itemCount > 0 ? msg.itemCount : 1;
+				items.reserve(count);
+				for (uint32_t i = 0; i < count; i++)
+				{
+					items.push_back(BatchItem<StageInput>{inputReceiver.Receive(this->GetReceiver(), msg)});
+				}
+			}
+			return items;
+		}
+
+		void QueueMessage(MessageHeader &msg)
+		{
+			std::vector<BatchItem<StageInput>> items = ReceiveItems(msg);
+			if (std::find(stealPeers.begin(), stealPeers.end(), msg.sender) != stealPeers.end())
+			{
+				stolenMessagesReceived++;
+			}
+			localQueue.push_back(MessageToReorder<StageInput>(msg, std::move(items)));
+		}
+
+		//Receives every message that already arrived into the local queue
+		void DrainWaitingMessages()
+		{
+			while (this->GetReceiver().HasMessageWaiting())
+			{
+				MessageHeader msg = this->GetReceiver().StartReceivingMessage();
+				if (msg.type == STOP_TYPE)
+				{
+					OnReceiveStop(msg);
+				}
+				else if (msg.type == MESSAGE_TYPE)
+				{
+					QueueMessage(msg);
+				}
+			}
+		}
+
+		//Sends a queued input message to another worker as it was received, keeping its id
+		void ForwardMessage(MessageToReorder<StageInput> &message, int target)
+		{
+			uint32_t count = (uint32_t)message.data.size();
+#ifdef DSPARTIMINGS
+			Timings timings = Timings{message.header.totalComputeTime, 0, 0};
+			MessageHeader header = this->GetSender().StartSendingMessageTo(target, message.header.id, message.header.ts, timings, count);
+#else
+			MessageHeader header = this->GetSender().StartSendingMessageTo(target, message.header.id, count);
+#endif
+			if (this->GetSender().MovesObjects())
+			{
+				this->GetSender().SendObject(header, std::make_shared<std::vector<BatchItem<StageInput>>>(std::move(message.data)));
+			}
+			else
+			{
+				for (auto &item : message.data)
+				{
+					inputReceiver.Send(this->GetSender(), header, item.value);
+				}
+			}
+			this->GetSender().FinishSendingMessage(header);
+		}
+
+		//True once nothing is queued and no message can come anymore, except by stealing
+		bool OutOfWork()
+		{
+			return sourcesStopped && localQueue.empty() && !stealPending && stolenMessagesExpected == stolenMessagesReceived;
+		}
+
+		//Gives the newest half of the queued messages to thief, then replies with their count. The thief stops
+		//asking a peer that is out of work, which may still get some by stealing. Messages are forwarded with
+		//blocking sends, so a worker waiting for the reply to its own steal gives nothing: otherwise two workers
+		//forwarding large messages to each other would both block until the other receives.
+		void GiveWork(int thief)
+		{
+			DrainWaitingMessages();
+			size_t count = stealPending ? 0 : localQueue.size() / 2;
+			for (size_t i = localQueue.size() - count; i < localQueue.size(); i++)
+			{
+				ForwardMessage(localQueue[i], thief);
+			}
+			localQueue.erase(localQueue.end() - count, localQueue.end());
+			//a worker with a steal of its own pending says it is out of work as well, or two idle workers
+			//asking each other would never tell
+			bool outOfWork = sourcesStopped && localQueue.empty();
+			this->GetSender().SendDemandSignalTo(thief, (int)count, outOfWork ? 1 : 0, STEAL_REPLY);
+		}
+
+		void OnStealReply(DemandSignal &reply)
+		{
+			stealPending = false;
+			stolenMessagesExpected += reply.amount;
+			if (reply.acked)
+			{
+				stealVictims.Remove(reply.sender);
+			}
+			if (reply.amount > 0)
+			{
+				failedSteals = 0;
+				stealBackoffMicroseconds = 0;
+				return;
+			}
+			if (++failedSteals >= std::max(stealVictims.Count(), (size_t)1))
+			{
+				failedSteals = 0;
+				stealBackoffMicroseconds = std::min(std::max(stealBackoffMicroseconds * 2, 16L), 1024L);
+				nextStealAttempt = std::chrono::steady_clock::now() + std::chrono::microseconds(stealBackoffMicroseconds);
+			}
+		}
+
+		void HandleStealSignals()
+		{
+			DemandSignal signal;
+			while (this->GetReceiver().TryReceivingDemand(signal))
+			{
+				if (signal.kind == STEAL_REQUEST)
+				{
+					GiveWork(signal.sender);
+				}
+				else if (signal.kind == STEAL_REPLY)
+				{
+					OnStealReply(signal);
+				}
+				else if (signal.kind == STEAL_FAREWELL)
+				{
+					farewellsReceived++;
+				}
+			}
+		}
+
+		//Processes the local queue, answering steal requests between messages
+		void ProcessLocalQueue()
+		{
+			DrainWaitingMessages();
+			while (true)
+			{
+				HandleStealSignals();
+				if (localQueue.empty())
+				{
+					return;
+				}
+				MessageToReorder<StageInput> next = std::move(localQueue.front());
+				localQueue.pop_front();
+				ProcessMessage(next.data, next.header);
+				RunAfterProcessMessageHandlers();
+				DrainWaitingMessages();
+			}
+		}
+
+		//Idle worker: asks peers for work until a message arrives. Once out of work with no peer left to steal from,
+		//it tells every peer and keeps answering their requests until all of them said the same.
+		void WaitForWorkOrSteal()
+		{
+			while (true)
+			{
+				HandleStealSignals();
+				if (!localQueue.empty())
+				{
+					//answering a request queued the messages that had arrived
+					ProcessLocalQueue();
+					continue;
+				}
+				if (this->GetReceiver().HasMessageWaiting() || HasFinished())
+				{
+					return;
+				}
+				if (!farewellSent && OutOfWork() && stealVictims.IsEmpty())
+				{
+					for (int peer : stealPeers)
+					{
+						this->GetSender().SendDemandSignalTo(peer, 0, 0, STEAL_FAREWELL);
+					}
+					farewellSent = true;
+					continue;
+				}
+				if (!stealPending && !stealVictims.IsEmpty() && std::chrono::steady_clock::now() >= nextStealAttempt)
+				{
+					this->GetSender().SendDemandSignalTo(stealVictims.Next(), 0, 0, STEAL_REQUEST);
+					stealPending = true;
+				}
+				std::this_thread::yield();
+			}
+		}
+
 	public:
 		DSparNode(
 			Wrapper<StageInput, StageOutput> &_stage,
@@ -239,18 +945,73 @@ namespace dspar
 
 				if (this->emitShouldUseLatestHeader)
 				{
-					//this->emitCalls++;
-					this->Emit(data, this->latestMessageHeader);
+					if (this->groupOutputsOfMessage)
+					{
+						this->outputBatch.push_back(BatchItem<StageOutput>{std::move(data)});
+					}
+					else
+					{
+						BatchItem<StageOutput> item{std::move(data)};
+						this->Emit(&item, 1, this->latestMessageHeader);
+					}
+				}
+				else if (this->nodeConfiguration.BatchSize > 1)
+				{
+					std::lock_guard<std::mutex> lock(this->outputBatchMutex);
+					if (this->outputBatch.empty())
+					{
+						this->outputBatchStart = std::chrono::steady_clock::now();
+						this->batchTimerWake.notify_one();
+					}
+					this->outputBatch.push_back(BatchItem<StageOutput>{std::move(data)});
+					if (this->outputBatch.size() >= (size_t)this->nodeConfiguration.BatchSize || this->BatchTimeoutExpired())
+					{
+						this->FlushOutputBatch();
+					}
 				}
 				else
 				{
-					//this->emitCalls++;
-					this->Emit(data);
+					BatchItem<StageOutput> item{std::move(data)};
+					this->Emit(&item, 1);
 				}
 			};
 			stage.SetEmitter(func);
 		}
 
+		//Work stealing: every worker of the farm, myRank among them
+		void SetStealPeers(std::vector<int> workers, int myRank)
+		{
+			stealPeers.clear();
+			auto self = std::find(workers.begin(), workers.end(), myRank);
+			//each worker starts asking the one after it
+			for (size_t i = 1; i < workers.size(); i++)
+			{
+				size_t index = ((self - workers.begin()) + i) % workers.size();
+				stealPeers.push_back(workers[index]);
+			}
+			stealVictims = dspar::CircularVector<int>(stealPeers);
+		}
+
+		std::vector<int> GetSourceRanks() override
+		{
+			//stolen messages come from the peers, which need rings too
+			std::vector<int> ranks = sources.Data();
+			ranks.insert(ranks.end(), stealPeers.begin(), stealPeers.end());
+			return ranks;
+		}
+
+		//Sends every output item to the target its key hashes to instead of scheduling messages
+		void SetRoutingKey(std::function<size_t(StageOutput &)> _routingKey, bool _consistentHashing)
+		{
+			routingKey = _routingKey;
+			consistentHashing = _consistentHashing;
+		}
+
+		bool HasFinished() override
+		{
+			return nodeConfiguration.WorkStealing && farewellSent && farewellsReceived == stealPeers.size();
+		}
+
 		AfterStart OnStart() override
 		{
 			if (this->nextStageRanks.Count() == 0)
@@ -263,18 +1024,57 @@ namespace dspar
 				dspar::globals::emitterRank = this->GetMyRank();
 			}
 
+			if (routingKey)
+			{
+				keyRouter.reset(new KeyRouter(nextStageRanks.Data(), consistentHashing));
+			}
+			if (nodeConfiguration.WeightByServiceRateDownstream || nodeConfiguration.JoinShortestQueueDownstream)
+			{
+				reportingTargets = nextStageRanks.Data();
+				targetRates.assign(reportingTargets.size(), 0);
+				targetCounters.assign(reportingTargets.size(), 0);
+				targetSentItems.assign(reportingTargets.size(), 0);
+				targetReceivedItems.assign(reportingTargets.size(), 0);
+				targetQueuedItems.assign(reportingTargets.size(), 0);
+				targetElapsedSeconds.assign(reportingTargets.size(), 0);
+				targetReportTimes.assign(reportingTargets.size(), std::chrono::steady_clock::now());
+				targetSampler.seed(this->GetMyRank() + 1);
+			}
+			lastRateReport = std::chrono::steady_clock::now();
+
+			this->GetSender().SetSingleBufferFraming(nodeConfiguration.SingleBufferFraming);
+			this->GetSender().SetEagerPayloadThreshold(nodeConfiguration.EagerPayloadBytes > 0 ? nodeConfiguration.EagerPayloadBytes : 0);
+			this->GetSender().SetMaxInFlightSendsPerTarget(nodeConfiguration.MaxInFlightSendsPerTarget);
+			this->GetReceiver().SetPrefetchDepth(nodeConfiguration.PrefetchDepth, nodeConfiguration.PrefetchPayloads);
+			this->GetSender().SetPersistentPartSize(outputSender.FixedWireSize());
+			this->GetReceiver().SetFixedWireSize(inputReceiver.FixedWireSize());
+
 			TRACE();
 			TRLABEL("FarmStage Start");
 
 			stage.Start();
 
 			TRLABEL("FarmStage Produce");
+			//outputs of received messages are sent per message, only a source holds a batch between emits
+			bool timedBatches = sources.Count() == 0 && nodeConfiguration.BatchSize > 1 && nodeConfiguration.BatchTimeoutMicroseconds > 0;
+			if (timedBatches && (CurrentTransport() != NULL || globals::threadMultiple))
+			{
+				StartBatchTimer();
+			}
 			stage.Produce();
+			StopBatchTimer();
+			FlushOutputBatch();
 
 			if (nodeConfiguration.AskForDemandUpstream)
 			{
 				TRBLOCK("Asking demand...");
-				this->SendDemand(sources.Next(), 1);
+				SendCredits(sources.Next(), nodeConfiguration.DemandCredits, 0);
+			}
+
+			bool reportsWhileBusy = nodeConfiguration.ReportServiceRateUpstream && nodeConfiguration.RateReportIntervalMicroseconds > 0;
+			if (reportsWhileBusy && (CurrentTransport() != NULL || globals::threadMultiple))
+			{
+				StartRateReporter();
 			}
 
 			if (sources.Count() > 0)
@@ -292,17 +1092,24 @@ namespace dspar
 			TRACE();
 			TRLABEL("OnReceiveMessage");
 
-			StageInput data = inputReceiver.Receive(this->GetReceiver(), msg);
+			if (nodeConfiguration.WorkStealing)
+			{
+				QueueMessage(msg);
+				ProcessLocalQueue();
+				return;
+			}
+
+			std::vector<BatchItem<StageInput>> items = ReceiveItems(msg);
 #ifdef DSPARTIMINGS
 			this->currentMessageEndRecv = Clock::now();
 #endif
 			if (nodeConfiguration.Ordered)
 			{
-				ReorderAndProcess(msg, data);
+				ReorderAndProcess(msg, items);
 			}
 			else
 			{
-				ProcessInput(data, msg);
+				ProcessMessage(items, msg);
 			}
 		};
 
@@ -379,15 +1186,94 @@ namespace dspar
 				}
 			}
 #endif
+		}
+
+		//Processes every item of one received message, then sends their outputs and asks for more
+		void ProcessMessage(std::vector<BatchItem<StageInput>> &items, MessageHeader &header)
+		{
+			groupOutputsOfMessage = nodeConfiguration.BatchSize > 1 || items.size() > 1;
+			auto processingStart = std::chrono::steady_clock::now();
+			if (nodeConfiguration.ReportServiceRateUpstream)
+			{
+				std::lock_guard<std::mutex> lock(rateReportMutex);
+				itemsReceived += items.size();
+				itemsLeftInMessage = (int)items.size();
+				currentItemStart = processingStart;
+			}
+
+			for (auto &item : items)
+			{
+				ProcessInput(item.value, header);
+				if (nodeConfiguration.ReportServiceRateUpstream)
+				{
+					std::lock_guard<std::mutex> lock(rateReportMutex);
+					itemsLeftInMessage--;
+					currentItemStart = std::chrono::steady_clock::now();
+				}
+			}
+
+			if (groupOutputsOfMessage)
+			{
+				groupOutputsOfMessage = false;
+				FlushOutputBatch(header);
+			}
+
+			if (nodeConfiguration.ReportServiceRateUpstream)
+			{
+				std::lock_guard<std::mutex> lock(rateReportMutex);
+				auto processingEnd = std::chrono::steady_clock::now();
+				busySecondsSinceReport += std::chrono::duration<double>(processingEnd - processingStart).count();
+				itemsSinceReport += (int)items.size();
+				if (std::chrono::duration_cast<std::chrono::microseconds>(processingEnd - lastRateReport).count() >= nodeConfiguration.RateReportIntervalMicroseconds)
+				{
+					ReportServiceRate(sources.Next(), false);
+				}
+			}
 
 			if (nodeConfiguration.AskForDemandUpstream)
 			{
-				TRLABEL("ProcessInput: Asking for demand");
-				this->SendDemand(sources.Next(), 1);
+				TRLABEL("ProcessMessage: Asking for demand");
+				if (creditsToReturn++ == 0)
+				{
+					creditsHeldSince = std::chrono::steady_clock::now();
+				}
+				if (CreditUpdateDue())
+				{
+					ReturnCredits(sources.Next());
+				}
+			}
+		}
+
+		//Without an explicit update interval, an idle worker returns its credits before it blocks so the emitter
+		//can refill it right away. With coalescing, credits wait for the interval or the timer.
+		void BeforeReceivingMessage() override
+		{
+			if (nodeConfiguration.WorkStealing)
+			{
+				WaitForWorkOrSteal();
+				return;
+			}
+			if (nodeConfiguration.ReportServiceRateUpstream)
+			{
+				//an idle worker reports right away, so the emitter sees its queue is empty
+				std::lock_guard<std::mutex> lock(rateReportMutex);
+				if (itemsSinceReport > 0 && !this->GetReceiver().HasMessageWaiting())
+				{
+					ReportServiceRate(sources.Next(), false);
+				}
+			}
+			if (creditsToReturn == 0)
+			{
+				return;
+			}
+			bool flushWhenIdle = nodeConfiguration.CreditUpdateInterval <= 0 || CreditTimeoutExpired();
+			if (flushWhenIdle && !this->GetReceiver().HasMessageWaiting())
+			{
+				ReturnCredits(sources.Next());
 			}
 		}
 
-		void ReorderAndProcess(MessageHeader &msg, StageInput &data)
+		void ReorderAndProcess(MessageHeader &msg, std::vector<BatchItem<StageInput>> &data)
 		{
 			TRACE();
 			//std::cout << "Unordered: "<<orderedMessages.size()<<std::endl;
@@ -395,44 +1281,26 @@ namespace dspar
 			{
 				{
 					TRBLOCK("Collector unordered: Processing data");
-					ProcessInput(data, msg);
+					ProcessMessage(data, msg);
 				}
 
 				this->currentMessage++;
 
-				while (true)
+				while (orderedMessages.Take(this->currentMessage, releasedMessages))
 				{
-					//	std::cout << "Ordered messages size " << orderedMessages.size() << std::endl;
-
-					if (orderedMessages.size() == 0)
-					{
-						return;
-					}
-
-					auto top = orderedMessages.top();
-
-					if (top.header.id > this->currentMessage)
-					{
-						//		std::cout << "Breaking, top ID " << top.header.id << " current " << this->currentMessage << std::endl;
-						break;
-					}
-
+					for (auto &next : releasedMessages)
 					{
-						//		std::cout << "Processing unordered ID " << top.header.id << std::endl;
 						TRBLOCK("Collector unordered: Processing data");
-						ProcessInput(top.data, top.header);
+						ProcessMessage(next.data, next.header);
+						processCalls++;
 					}
-
-					orderedMessages.pop();
-					//std::cout << "Popped" << std::endl;
+					releasedMessages.clear();
 					this->currentMessage++;
-					processCalls++;
 				}
 			}
 			else
 			{
-				MessageToReorder<StageInput> msgReorder(msg, data);
-				orderedMessages.push(msgReorder);
+				orderedMessages.Insert(msg.id, this->currentMessage, MessageToReorder<StageInput>(msg, std::move(data)));
 			}
 		}
 
@@ -441,12 +1309,14 @@ namespace dspar
 			TRACE();
 			DSPAR_DEBUG("FarmStage running OnStop");
 			stage.End();
+			FlushOutputBatch();
 
 			//We wait on final demands here because we can only tell the workers to stop when our sources stop.
 			if (nodeConfiguration.WaitForDemandDownstream)
 			{
 				DSPAR_DEBUG("FarmStage OnStop running WaitFinalDemands");
 				WaitFinalDemands();
+				DSPAR_DEBUG("Received " << dspar::globals::demandSignalsReceived << " demand signals, " << dspar::globals::controlMessagesSaved << " control messages saved by coalescing");
 			}
 			else
 			{
@@ -456,12 +1326,33 @@ namespace dspar
 					DSPAR_DEBUG("FarmStage sending stop to " << rank);
 					this->GetSender().SendStopMessageTo(rank);
 				}
+				if (nodeConfiguration.WeightByServiceRateDownstream || nodeConfiguration.JoinShortestQueueDownstream)
+				{
+					WaitFinalRateReports();
+				}
 			}
 		};
 
 		virtual StopResponse OnReceiveStop(MessageHeader &msg) override
 		{
 			TRACE();
+			if (nodeConfiguration.WorkStealing)
+			{
+				//the node leaves through HasFinished, once no peer can steal from it anymore
+				this->sources.Remove(msg.sender);
+				sourcesStopped = this->sources.IsEmpty();
+				return StopResponse::Ignore;
+			}
+			if (nodeConfiguration.AskForDemandUpstream)
+			{
+				//the source waits for every credit before it stops
+				ReturnCredits(msg.sender);
+			}
+			if (nodeConfiguration.ReportServiceRateUpstream)
+			{
+				StopRateReporter();
+				ReportServiceRate(msg.sender, true);
+			}
 			this->sources.Remove(msg.sender);
 
 			if (this->sources.IsEmpty())
@@ -473,7 +1364,7 @@ namespace dspar
 				if (nodeConfiguration.AskForDemandUpstream)
 				{
 					TRLABEL("OnDemand worker: Asking for demand during stop");
-					this->SendDemand(this->sources.Next(), 1);
+					SendCredits(this->sources.Next(), nodeConfiguration.DemandCredits, 0);
 				}
 
 				return StopResponse::Ignore;
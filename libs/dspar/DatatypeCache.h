@@ -0,0 +1,217 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <vector>
+#include "mpi.h"
+
+namespace dspar
+{
+	//Datatype of one send or receive, used with the first block as buffer. Types built for that operation
+	//alone are freed with the handle; MPI keeps them alive until the operations already posted complete.
+	class BlockDatatype
+	{
+	private:
+		MPI_Datatype type;
+		bool owned;
+
+	public:
+		BlockDatatype(MPI_Datatype _type, bool _owned) : type(_type), owned(_owned) {}
+		BlockDatatype(const BlockDatatype &) = delete;
+		BlockDatatype &operator=(const BlockDatatype &) = delete;
+
+		BlockDatatype(BlockDatatype &&other) : type(other.type), owned(other.owned)
+		{
+			other.owned = false;
+		}
+
+		~BlockDatatype()
+		{
+			if (owned)
+			{
+				MPI_Type_free(&type);
+			}
+		}
+
+		operator MPI_Datatype() const
+		{
+			return type;
+		}
+	};
+
+	//Committed MPI datatypes describing a set of memory blocks (rows of a T**, the vectors of a
+	//std::vector<std::vector<T>>...) relative to the first one, so the whole set moves in one message.
+	//Types are kept per shape, the block lengths and their displacements from the first block, and reused
+	//by every item with the same shape whatever its address.
+	class BlockDatatypeCache
+	{
+	private:
+		typedef std::tuple<int, size_t, MPI_Aint> Stride;
+		typedef std::pair<std::vector<size_t>, std::vector<MPI_Aint>> Shape;
+
+		//equal blocks at a constant stride, the usual layout of T** rows allocated in one go
+		std::map<Stride, MPI_Datatype> strided;
+		//anything else, described block by block
+		std::map<Shape, MPI_Datatype> indexed;
+		//Rows allocated one by one (as the vectors a receiver creates) lie at other offsets for every item,
+		//and may still look strided (two rows of the same length always do). Such a shape gets a type for
+		//its operation alone; it is only cached the second time it is seen.
+		std::set<Stride> stridesSeenOnce;
+		std::set<Shape> shapesSeenOnce;
+
+		//all are bounded, cleared when full
+		static const size_t MAX_CACHED_TYPES = 64;
+		static const size_t MAX_SEEN_SHAPES = 256;
+
+		static MPI_Datatype Commit(MPI_Datatype type)
+		{
+			MPI_Type_commit(&type);
+			return type;
+		}
+
+		static void Free(MPI_Datatype type)
+		{
+			MPI_Type_free(&type);
+		}
+
+		//Caches the committed type of key if it was seen before, otherwise returns it for one operation
+		template <typename Key>
+		static BlockDatatype Admit(std::map<Key, MPI_Datatype> &cache, std::set<Key> &seenOnce, Key &key, MPI_Datatype type)
+		{
+			if (seenOnce.erase(key) == 0)
+			{
+				if (seenOnce.size() >= MAX_SEEN_SHAPES)
+				{
+					seenOnce.clear();
+				}
+				seenOnce.insert(std::move(key));
+				return BlockDatatype(type, true);
+			}
+			if (cache.size() >= MAX_CACHED_TYPES)
+			{
+				for (auto &entry : cache)
+				{
+					Free(entry.second);
+				}
+				cache.clear();
+			}
+			cache[key] = type;
+			return BlockDatatype(type, false);
+		}
+
+	public:
+		BlockDatatypeCache() {}
+		BlockDatatypeCache(const BlockDatatypeCache &) = delete;
+		BlockDatatypeCache &operator=(const BlockDatatypeCache &) = delete;
+
+		~BlockDatatypeCache()
+		{
+			Clear();
+		}
+
+		void Clear()
+		{
+			for (auto &entry : strided)
+			{
+				Free(entry.second);
+			}
+			for (auto &entry : indexed)
+			{
+				Free(entry.second);
+			}
+			strided.clear();
+			indexed.clear();
+			stridesSeenOnce.clear();
+			shapesSeenOnce.clear();
+		}
+
+		//lengths in bytes, displacements in bytes from the first block. Empty blocks must be left out,
+		//and the blocks must add up to at most DSPAR_MAX_CHUNK_BYTES (see BlockList::Split).
+		BlockDatatype Get(const std::vector<size_t> &lengths, const std::vector<MPI_Aint> &displacements)
+		{
+			bool uniform = true;
+			MPI_Aint stride = displacements.size() > 1 ? displacements[1] - displacements[0] : 0;
+			for (size_t i = 1; i < lengths.size() && uniform; i++)
+			{
+				uniform = lengths[i] == lengths[0] && displacements[i] - displacements[i - 1] == stride;
+			}
+
+			if (uniform)
+			{
+				Stride key = std::make_tuple((int)lengths.size(), lengths[0], stride);
+				auto it = strided.find(key);
+				if (it != strided.end())
+				{
+					return BlockDatatype(it->second, false);
+				}
+				MPI_Datatype type;
+				MPI_Type_create_hvector((int)lengths.size(), (int)lengths[0], stride, MPI_BYTE, &type);
+				return Admit(strided, stridesSeenOnce, key, Commit(type));
+			}
+
+			Shape key = std::make_pair(lengths, displacements);
+			auto it = indexed.find(key);
+			if (it != indexed.end())
+			{
+				return BlockDatatype(it->second, false);
+			}
+			std::vector<int> intLengths(lengths.begin(), lengths.end());
+			MPI_Datatype type;
+			MPI_Type_create_hindexed((int)lengths.size(), intLengths.data(), displacements.data(), MPI_BYTE, &type);
+			return Admit(indexed, shapesSeenOnce, key, Commit(type));
+		}
+	};
+
+	//Non-empty blocks of a structure, in the order they are sent
+	struct BlockList
+	{
+		std::vector<char *> blocks;
+		std::vector<size_t> lengths;
+		size_t totalBytes = 0;
+
+		void Add(const void *block, size_t bytes)
+		{
+			if (bytes == 0)
+			{
+				return;
+			}
+			blocks.push_back((char *)block);
+			lengths.push_back(bytes);
+			totalBytes += bytes;
+		}
+
+		//Cuts the blocks into lists of chunkBytes (the last one may be shorter), splitting blocks where needed.
+		//Chunks are byte ranges of the whole list, so both ends agree on them even if their blocks differ.
+		std::vector<BlockList> Split(size_t chunkBytes) const
+		{
+			std::vector<BlockList> chunks(1);
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				size_t offset = 0;
+				while (offset < lengths[i])
+				{
+					if (chunks.back().totalBytes == chunkBytes)
+					{
+						chunks.emplace_back();
+					}
+					size_t bytes = std::min(lengths[i] - offset, chunkBytes - chunks.back().totalBytes);
+					chunks.back().Add(blocks[i] + offset, bytes);
+					offset += bytes;
+				}
+			}
+			return chunks;
+		}
+
+		std::vector<MPI_Aint> Displacements() const
+		{
+			std::vector<MPI_Aint> displacements(blocks.size());
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				displacements[i] = (MPI_Aint)blocks[i] - (MPI_Aint)blocks[0];
+			}
+			return displacements;
+		}
+	};
+} // namespace dspar
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 namespace dspar
 {
 	struct DemandSignal
@@ -6,5 +7,16 @@ namespace dspar
 		int sender;
 		int target;
 		int amount;
+		//processed messages this signal acknowledges, 0 for the initial credit advertisement
+		int acked;
+		//STEAL_* or RATE_REPORT kind of a signal, 0 for credits
+		int kind;
+		//items per second of processing time, in RATE_REPORT signals
+		double rate;
+		//RATE_REPORT: items the sender received so far, those it has not finished yet and the seconds it
+		//has been processing the first of them
+		uint64_t received;
+		int queued;
+		double elapsed;
 	};
 } // namespace dspar
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <map>
 #include "Timings.h"
 
 
@@ -7,12 +8,37 @@ namespace dspar
 {
     namespace globals
     {
-        std::vector<Timings> collectorTimings;
-        bool isCollector = false;
-        int collectorRank = -1;
+        //Written by the node running on the thread: with StartInThreads every node has its own,
+        //read them from the thread that ran it
+        thread_local std::vector<Timings> collectorTimings;
+        thread_local bool isCollector = false;
+        thread_local int collectorRank = -1;
     
-        bool isEmitter = false;
-        int emitterRank = -1;
+        thread_local bool isEmitter = false;
+        thread_local int emitterRank = -1;
+
+        //Demand signals the on-demand emitter received, and how many fewer these were than one per processed message
+        thread_local uint64_t demandSignalsReceived = 0;
+        thread_local uint64_t controlMessagesSaved = 0;
+
+        //Smoothed service rate (items per second) of each worker rank, as the weighted emitter last saw it
+        thread_local std::map<int, double> workerWeights;
+
+        //Settings of the whole process, set before the graph starts
+
+        //Bytes of each shared memory ring between ranks of the same host, 0 sends everything through MPI
+        uint64_t sharedMemoryRingBytes = 0;
+
+        //Bytes of each RMA ring, used for every stream edge instead of two-sided MPI when not 0
+        uint64_t rmaRingBytes = 0;
+
+        //Size of the chunks large payload parts are split into, the same on every process
+        uint64_t chunkBytes = DSPAR_CHUNK_BYTES;
+
+        //MPI is initialized with MPI_Init_thread(MPI_THREAD_MULTIPLE) when requested, and threadMultiple
+        //tells whether it was provided, so several threads of a rank may receive stream messages
+        bool requestThreadMultiple = false;
+        bool threadMultiple = false;
 
         int argc = -1;
         char** argv = NULL;
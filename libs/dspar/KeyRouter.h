@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+
+namespace dspar
+{
+	//Maps the hash of an item's key to a target rank, so items with the same key always reach the same target.
+	//Modulo routing spreads keys evenly over the targets. The consistent hash ring gives each target many points
+	//and routes a key to the first point after it, so adding or removing a target only moves about 1/n of the keys.
+	class KeyRouter
+	{
+	private:
+		std::vector<int> targets;
+		//points of the consistent hash ring and their targets, sorted, empty with modulo routing
+		std::vector<std::pair<uint64_t, int>> ring;
+
+		//std::hash of integers is the identity, keys are mixed before they are spread
+		static uint64_t Mix(uint64_t x)
+		{
+			x ^= x >> 30;
+			x *= 0xbf58476d1ce4e5b9ULL;
+			x ^= x >> 27;
+			x *= 0x94d049bb133111ebULL;
+			x ^= x >> 31;
+			return x;
+		}
+
+	public:
+		static const int VIRTUAL_NODES = 128;
+
+		KeyRouter(std::vector<int> _targets, bool consistentHashing) : targets(_targets)
+		{
+			if (!consistentHashing)
+			{
+				return;
+			}
+			for (int target : targets)
+			{
+				for (uint64_t i = 0; i < VIRTUAL_NODES; i++)
+				{
+					ring.push_back(std::make_pair(Mix(((uint64_t)(uint32_t)target << 32) | i), target));
+				}
+			}
+			std::sort(ring.begin(), ring.end());
+		}
+
+		int Route(size_t keyHash) const
+		{
+			uint64_t point = Mix(keyHash);
+			if (ring.empty())
+			{
+				return targets[point % targets.size()];
+			}
+			auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(point, INT_MIN));
+			return it == ring.end() ? ring.front().second : it->second;
+		}
+	};
+} // namespace dspar
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <functional>
 #include "Message.h"
 #include "DemandSignal.h"
 #include "MPIUtils.h"
 #include "AsyncMPIRequest.h"
+#include "DatatypeCache.h"
+#include "Transport.h"
 
 namespace dspar
 {
@@ -43,88 +46,148 @@ namespace dspar
 	{
 	private:
 		MPI_Comm comm;
+		//MPITransport, or the transport of the thread running the node
+		Transport &transport;
+
+		//set between BeginReplay and EndReplay, every part is read from the replayed bytes
+		bool replaying;
+		const char *replayCursor;
+		const char *replayEnd;
+
+		void ReceiveBytes(MessageHeader &header, void *buffer, size_t bytes)
+		{
+			if (!replaying)
+			{
+				transport.ReceiveBytes(header, buffer, bytes);
+				return;
+			}
+			if ((size_t)(replayEnd - replayCursor) < bytes)
+			{
+				SERDE_ERROR("Replayed item too short. Got " << (replayEnd - replayCursor) << " bytes left, expected to receive " << bytes << ". Aborting to prevent errors");
+				MPI_Abort(comm, 1);
+			}
+			memcpy(buffer, replayCursor, bytes);
+			replayCursor += bytes;
+		}
+
+		//Counterpart of MPISender::SendBlocks
+		void ReceiveBlocks(MessageHeader &header, const BlockList &list)
+		{
+			if (!replaying)
+			{
+				transport.ReceiveBlocks(header, list);
+				return;
+			}
+			for (size_t i = 0; i < list.blocks.size(); i++)
+			{
+				ReceiveBytes(header, list.blocks[i], list.lengths[i]);
+			}
+		}
+
+		//Counterpart of MPISender::SendSized. allocate(count) returns where count elements of elementSize bytes go.
+		template <typename Allocate>
+		void ReceiveSized(MessageHeader &header, size_t elementSize, Allocate allocate)
+		{
+			if (!replaying)
+			{
+				transport.ReceiveSized(header, elementSize, allocate);
+				return;
+			}
+			size_t count;
+			ReceiveBytes(header, &count, sizeof(size_t));
+			if (count > 0)
+			{
+				ReceiveBytes(header, allocate(count), count * elementSize);
+			}
+		}
 
 	public:
-		MPIReceiver(MPI_Comm _comm) : comm(_comm) {}
+		MPIReceiver(MPI_Comm _comm, Transport &_transport) : comm(_comm), transport(_transport), replaying(false), replayCursor(NULL), replayEnd(NULL) {}
+
+		//Keeps depth header receives posted with MPI_Irecv while the current item is processed.
+		//With prefetchPayloads, packed payloads of already arrived headers are also posted.
+		void SetPrefetchDepth(int depth, bool prefetchPayloads)
+		{
+			transport.SetPrefetchDepth(depth, prefetchPayloads);
+		}
+
+		//Declares that every item received is one part of bytes, as given by a serializer with a fixed wire size.
+		//Parts of that size received through MPI (separate framing) use a persistent request per source, set up
+		//once with MPI_Recv_init on a staging buffer and started per item; larger than DSPAR_SEGMENT_COPY_THRESHOLD
+		//they keep being received in place, copying them out costs more than the setup it saves. When prefetching
+		//payloads, the parts of separately framed items are also received ahead into the prefetch slots.
+		//0 disables both.
+		void SetFixedWireSize(size_t bytes)
+		{
+			transport.SetFixedWireSize(bytes);
+		}
+
+		//Stream messages from sources that have a ring in channels are read from it
+		void SetStreamChannels(StreamChannels *channels)
+		{
+			transport.SetStreamChannels(channels);
+		}
+
+		//Cancels the receives still posted, called when the node stops receiving
+		void StopPrefetching()
+		{
+			transport.StopReceiving();
+		}
 
 		MessageHeader StartReceivingMessage()
 		{
-			MessageHeader header;
-			MPI_Status status;
-			MPI_Recv(&header, sizeof(MessageHeader), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, &status);
-			header.sender = status.MPI_SOURCE;
-			return header;
+			return transport.ReceiveHeader();
+		}
+
+		//True when the transport hands emitted objects over instead of their serialized bytes
+		bool MovesObjects()
+		{
+			return transport.MovesObjects();
+		}
+
+		std::shared_ptr<void> ReceiveObject(MessageHeader &header)
+		{
+			return transport.ReceiveObject(header);
 		}
 
 		AsyncMPIRequest<MessageHeader> StartReceivingMessageAsync()
 		{
-			AsyncMPIRequest<MessageHeader> asyncRequest;
-			MPI_Irecv(&asyncRequest.data, sizeof(MessageHeader), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, &asyncRequest.request);
-			return asyncRequest;
+			return transport.ReceiveHeaderAsync();
 		}
 
 		DemandSignal StartReceivingDemand()
 		{
-			DemandSignal demand;
-			MPI_Status status;
-			MPI_Recv(&demand, sizeof(DemandSignal), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_DEMAND, comm, &status);
-			demand.sender = status.MPI_SOURCE;
-			//LOG_DEBUG("Received demand from "<<status.MPI_SOURCE);
-			return demand;
+			return transport.ReceiveDemand();
 		}
 
-		template <typename T>
-		void Receive(MessageHeader &header, T *buffer)
+		//Receives a demand signal only if one already arrived
+		bool TryReceivingDemand(DemandSignal &demand)
 		{
-			MPI_Status status;
-			MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-
-			int count;
-			MPI_Get_count(&status, MPI_BYTE, &count);
+			return transport.TryReceivingDemand(demand);
+		}
 
-			if (count != sizeof(T))
-			{
-				SERDE_ERROR("Send and receives of wrong size. Got " << count << " bytes, expected to receive " << sizeof(T) << ". Aborting to prevent errors");
-				MPI_Abort(comm, 1);
-			}
+		//True when the next StartReceivingMessage will not block waiting for a header
+		bool HasMessageWaiting()
+		{
+			return transport.HasMessageWaiting();
+		}
 
-			MPI_Recv(buffer, count, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+		template <typename T>
+		void Receive(MessageHeader &header, T *buffer)
+		{
+			ReceiveBytes(header, buffer, sizeof(T));
 		}
 
 		template <typename T, size_t I, size_t J>
 		void Receive(MessageHeader &header, T (*buffer)[I][J])
 		{
-			MPI_Status status;
-			MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-
-			int count;
-			MPI_Get_count(&status, MPI_BYTE, &count);
-
-			if (count != sizeof(T) * I * J)
-			{
-				SERDE_ERROR("Send and receives of wrong size. Got " << count << " byte, expected to receive " << sizeof(T) * I * J << ". Aborting to prevent errors");
-				MPI_Abort(comm, 1);
-			}
-
-			MPI_Recv(buffer, count, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+			ReceiveBytes(header, buffer, sizeof(T) * I * J);
 		}
 
 		template <typename T, size_t I>
 		void Receive(MessageHeader &header, T (*buffer)[I])
 		{
-			MPI_Status status;
-			MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-
-			int count;
-			MPI_Get_count(&status, MPI_BYTE, &count);
-
-			if (count != sizeof(T) * I)
-			{
-				SERDE_ERROR("Send and receives of wrong size. Got " << count << " byte, expected to receive " << sizeof(T) * I << ". Aborting to prevent errors");
-				MPI_Abort(comm, 1);
-			}
-
-			MPI_Recv(buffer, count, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+			ReceiveBytes(header, buffer, sizeof(T) * I);
 		}
 
 		template <typename T, size_t I>
@@ -142,13 +205,10 @@ namespace dspar
 
 		void Receive(MessageHeader &header, std::string *str)
 		{
-			size_t size;
-			Receive(header, &size);
-			if (size > 0)
-			{
+			ReceiveSized(header, 1, [str](size_t size) -> void * {
 				str->resize(size);
-				Receive(header, (char*)str->data(), size);
-			}
+				return (void *)str->data();
+			});
 		}
 
 		template <typename T>
@@ -160,13 +220,10 @@ namespace dspar
 			static_assert(!std::is_pointer<T>::value,
 						  "Wrong method call. Passing a T** buffer to this function is forbidden - use Receive(header, buffer, dimension1, dimension2). Also check if you're not passing a double pointer (e.g. &arr where \"arr\" is T* already)");
 
-			size_t size;
-			Receive(header, &size);
-			if (size > 0)
-			{
+			ReceiveSized(header, sizeof(T), [array](size_t size) -> void * {
 				array->resize(size);
-				Receive(header, array->data(), size);
-			}
+				return (void *)array->data();
+			});
 		}
 		/*
 		template <typename T>
@@ -209,31 +266,14 @@ namespace dspar
 			//Optimization: Resize to final size
 			array2d->resize(sizes.size());
 
-			//allocate arrays in 1 go
-			for (int i = 0; i < sizes.size(); i++)
-			{
-				if (sizes[i] > 0)
-				{
-					(*array2d)[i].resize(sizes[i]);
-				}
-				else
-				{
-					//std::cout << "skipped at "<<i<<std::endl;
-				}
-			}
-
-			//receive all data
-			for (int i = 0; i < sizes.size(); i++)
+			//allocate arrays in 1 go, then receive all data in one message
+			BlockList rows;
+			for (size_t i = 0; i < sizes.size(); i++)
 			{
-				if (sizes[i] > 0)
-				{
-					Receive(header, (*array2d)[i].data(), sizes[i]);
-				}
-				else
-				{
-					//std::cout << "skipped at "<<i<<std::endl;
-				}
+				(*array2d)[i].resize(sizes[i]);
+				rows.Add((*array2d)[i].data(), sizes[i] * sizeof(T));
 			}
+			ReceiveBlocks(header, rows);
 		}
 
 		template <typename T>
@@ -244,18 +284,26 @@ namespace dspar
 
 			static_assert(!std::is_pointer<T>::value,
 						  "Wrong method call. Passing a T** buffer to this function is forbidden - use Receive(header, buffer, dimension1, dimension2). Also check if you're not passing a double pointer (e.g. &arr where \"arr\" is T* already)");
+			//row count of every plane followed by the size of every row, see MPISender
 			size_t size;
 			Receive(header, &size);
-			if (size > 0)
+			std::vector<size_t> shape;
+			Receive(header, &shape);
+
+			array->resize(size);
+			BlockList rows;
+			size_t rowSize = size;
+			for (size_t i = 0; i < size; i++)
 			{
-				array->reserve(size);
-				for (int i = 0; i < size; i++)
+				std::vector<std::vector<T>> &plane = (*array)[i];
+				plane.resize(shape[i]);
+				for (auto &row : plane)
 				{
-					std::vector<std::vector<T>> arr;
-					Receive(header, &arr);
-					array->push_back(arr);
+					row.resize(shape[rowSize++]);
+					rows.Add(row.data(), row.size() * sizeof(T));
 				}
 			}
+			ReceiveBlocks(header, rows);
 		}
 
 		template <typename T>
@@ -268,23 +316,9 @@ namespace dspar
 			static_assert(!std::is_pointer<T>::value,
 						  "Wrong method call. Passing a T** buffer to this function is forbidden - use Receive(header, buffer, dimension1, dimension2). Also check if you're not passing a double pointer (e.g. &arr where \"arr\" is T* already)");
 
-			MPI_Status status;
-			MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-
 			SERDE_DEBUG("Sizeof " << typeid(T).name() << " is " << sizeof(T) << "and dimension1 is " << dimension1);
 
-			int expectedCount = (int)(sizeof(T) * dimension1);
-
-			int count;
-			MPI_Get_count(&status, MPI_BYTE, &count);
-
-			if (count != expectedCount)
-			{
-				SERDE_ERROR("Send and receives of wrong size. Got " << count << " bytes, expected to receive " << expectedCount << ". Aborting to prevent errors");
-				MPI_Abort(comm, 1);
-			}
-
-			MPI_Recv(buffer, count, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+			ReceiveBytes(header, buffer, sizeof(T) * dimension1);
 		}
 
 		template <typename T>
@@ -296,22 +330,14 @@ namespace dspar
 			static_assert(!std::is_pointer<T>::value,
 						  "Wrong method call. Passing a T*** buffer to this function is forbidden - use Receive(header, buffer, dimension1, dimension2, dimension3). Also check if you're not passing a trple pointer (&arr where arr is T** already)");
 
-			int expectedRowCount = (int)(sizeof(T) * dimension2);
+			size_t expectedRowCount = sizeof(T) * dimension2;
 
+			BlockList rows;
 			for (size_t i = 0; i < dimension1; i++)
 			{
-				MPI_Status status;
-				MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-				int count;
-				MPI_Get_count(&status, MPI_BYTE, &count);
-				if (count != expectedRowCount)
-				{
-					SERDE_ERROR("Send and receives of wrong size. Got " << count << " bytes, expected to receive " << expectedRowCount << ". Aborting to prevent errors now");
-					MPI_Abort(comm, 1);
-					break;
-				}
-				MPI_Recv(buffer[i], expectedRowCount, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+				rows.Add(buffer[i], expectedRowCount);
 			}
+			ReceiveBlocks(header, rows);
 		}
 
 		template <typename T>
@@ -323,25 +349,59 @@ namespace dspar
 			static_assert(!std::is_pointer<T>::value,
 						  "We only support passing dynamic arrays up to 3 levels of indirection (T***). If you need passing 4D arrays, send multiple T*** buffers instead. Also check if you're not passing a 4d pointer (&arr where arr is T*** already)");
 
-			int expectedRowCount = sizeof(T) * dimension3;
+			size_t expectedRowCount = sizeof(T) * dimension3;
 
+			BlockList rows;
 			for (size_t i = 0; i < dimension1; i++)
 			{
 				for (size_t j = 0; j < dimension2; j++)
 				{
-					MPI_Status status;
-					MPI_Probe(header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
-					int count;
-					MPI_Get_count(&status, MPI_BYTE, &count);
-					if (count != expectedRowCount)
-					{
-						SERDE_ERROR("Send and receives of wrong size. Got " << count << " bytes, expected to receive " << expectedRowCount << ". Aborting to prevent errors");
-						MPI_Abort(comm, 1);
-						break;
-					}
-					MPI_Recv(buffer[i][j], expectedRowCount, MPI_BYTE, header.sender, MPI_DSPAR_STREAM_MESSAGE, comm, &status);
+					rows.Add(buffer[i][j], expectedRowCount);
 				}
 			}
+			ReceiveBlocks(header, rows);
+		}
+
+		//Makes the Receive calls of header's item read the bytes given instead, until EndReplay. Returns the header
+		//to receive them with; they must be read with it. Counterpart of MPISender::BeginCapture, replays do not nest.
+		MessageHeader BeginReplay(const MessageHeader &header, const char *bytes, size_t count)
+		{
+			replaying = true;
+			replayCursor = bytes;
+			replayEnd = bytes + count;
+			MessageHeader replay = header;
+			replay.framing = FRAME_PACKED_TAIL;
+			return replay;
+		}
+
+		//Returns to the item being received, false when the replayed bytes were not all read
+		bool EndReplay()
+		{
+			bool complete = replayCursor == replayEnd;
+			replaying = false;
+			return complete;
+		}
+
+		//Reads the fixed prefix of an item sent with MPISender::SendSegments, its segments follow with ReceiveSegments
+		void ReceiveSegmentPrefix(MessageHeader &header, void *prefix, size_t prefixBytes)
+		{
+			if (!replaying)
+			{
+				transport.ReceiveSegmentPrefix(header, prefix, prefixBytes);
+				return;
+			}
+			ReceiveBytes(header, prefix, prefixBytes);
+		}
+
+		//Receives the segments of the item whose prefix was just read, directly into the given blocks
+		void ReceiveSegments(MessageHeader &header, const BlockList &segments)
+		{
+			if (!replaying)
+			{
+				transport.ReceiveSegments(header, segments);
+				return;
+			}
+			ReceiveBlocks(header, segments);
 		}
 
 		MPI_Comm GetComm()
@@ -4,6 +4,8 @@
 #include "DemandSignal.h"
 #include "MPIUtils.h"
 #include "AsyncMPIRequest.h"
+#include "DatatypeCache.h"
+#include "Transport.h"
 
 namespace dspar
 {
@@ -13,51 +15,204 @@ namespace dspar
 	private:
 		MPI_Comm comm;
 		int currentRank;
+		//MPITransport, or the transport of the thread running the node
+		Transport &transport;
+
+		//set between BeginCapture and EndCapture, parts are appended to it instead of sent
+		std::vector<char> *capture;
+
+		void SendBytes(const MessageHeader &header, const void *buffer, size_t bytes)
+		{
+			if (capture != NULL)
+			{
+				const char *data = (const char *)buffer;
+				capture->insert(capture->end(), data, data + bytes);
+				return;
+			}
+			transport.SendBytes(header, buffer, bytes);
+		}
+
+		//Sends all blocks as one payload part. With separate framing they go in a single MPI message
+		//described by a cached datatype, otherwise they are appended to the packed buffer or ring.
+		void SendBlocks(const MessageHeader &header, const BlockList &list)
+		{
+			if (capture == NULL)
+			{
+				transport.SendBlocks(header, list);
+				return;
+			}
+			for (size_t i = 0; i < list.blocks.size(); i++)
+			{
+				SendBytes(header, list.blocks[i], list.lengths[i]);
+			}
+		}
 
 	public:
 		uint64_t messagesSent;
 
-		MPISender(MPI_Comm _comm) : comm(_comm), messagesSent(0)
+		MPISender(MPI_Comm _comm, Transport &_transport) : comm(_comm), transport(_transport), capture(NULL), messagesSent(0)
+		{
+			currentRank = transport.GetMyRank();
+		}
+
+		//When enabled, the header and every SendTo of one item are packed and sent as one MPI message
+		void SetSingleBufferFraming(bool enabled)
+		{
+			transport.SetSingleBufferFraming(enabled);
+		}
+
+		//Items to targets that have a ring in channels are written to it instead of sent with MPI
+		void SetStreamChannels(StreamChannels *channels)
+		{
+			transport.SetStreamChannels(channels);
+		}
+
+		//Without single buffer framing, items whose payload is at most bytes are still sent inline with their
+		//header in one message. Larger items fall back to one message per part. 0 disables it.
+		void SetEagerPayloadThreshold(size_t bytes)
+		{
+			transport.SetEagerPayloadThreshold(bytes);
+		}
+
+		//Parts of exactly bytes sent through MPI (separate framing) are copied to one of DSPAR_PERSISTENT_SLOTS
+		//staging slots of their target and sent with a persistent request set up once (MPI_Send_init) and
+		//started per item. Meant for edges whose serializer declares a fixed wire size. 0 disables it.
+		void SetPersistentPartSize(size_t bytes)
+		{
+			transport.SetPersistentPartSize(bytes);
+		}
+
+		//Uses MPI_Isend for emitted items, with at most maxInFlight items not yet completed per target.
+		//The data is copied (or the packed buffer kept) so the caller may reuse its memory right away.
+		//0 restores blocking sends.
+		void SetMaxInFlightSendsPerTarget(int maxInFlight)
+		{
+			transport.SetMaxInFlightSendsPerTarget(maxInFlight);
+		}
+
+		//Until EndCapture, every SendTo appends its bytes to buffer instead of sending them, so a serializer
+		//can transform the serialized item (see CompressedSenderReceiver). Captures do not nest.
+		void BeginCapture(std::vector<char> &buffer)
+		{
+			capture = &buffer;
+		}
+
+		void EndCapture()
+		{
+			capture = NULL;
+		}
+
+		//Completes the item started by StartSendingMessageTo: sends the packed buffer when
+		//single buffer framing is enabled, and tracks the item's requests when sending asynchronously.
+		void FinishSendingMessage(MessageHeader &header)
+		{
+			transport.FinishMessage(header);
+		}
+
+		//Releases the buffers of items whose sends already completed, without blocking
+		void ReapCompletedSends()
+		{
+			transport.ReapCompletedSends();
+		}
+
+		void WaitForPendingSends()
+		{
+			transport.WaitForPendingSends();
+		}
+
+		//Sends the fixed prefix of an item and all its segments (see SegmentSenderReceiver). With separate framing
+		//small items are copied into one message, larger ones go as the prefix plus one datatype message.
+		void SendSegments(const MessageHeader &header, const void *prefix, size_t prefixBytes, const BlockList &segments)
+		{
+			if (capture == NULL)
+			{
+				transport.SendSegments(header, prefix, prefixBytes, segments);
+				return;
+			}
+			SendBytes(header, prefix, prefixBytes);
+			SendBlocks(header, segments);
+		}
+
+		//Sends count elements preceded by count. With separate framing, small payloads go as one message
+		//of size and data; larger ones as the size then the data, which the receiver gets without probing.
+		void SendSized(const MessageHeader &header, size_t count, const void *data, size_t bytes)
+		{
+			if (capture == NULL)
+			{
+				transport.SendSized(header, count, data, bytes);
+				return;
+			}
+			SendBytes(header, &count, sizeof(size_t));
+			if (count > 0)
+			{
+				SendBytes(header, data, bytes);
+			}
+		}
+
+		//True when the transport hands emitted objects over instead of their serialized bytes
+		bool MovesObjects()
 		{
-			dspar::MPIUtils utils;
-			currentRank = utils.GetMyRank(_comm);
+			return transport.MovesObjects();
 		}
 
-		DemandSignal SendDemandSignalTo(int target, int amount)
+		void SendObject(const MessageHeader &header, std::shared_ptr<void> object)
 		{
-			DemandSignal msg;
+			transport.SendObject(header, std::move(object));
+		}
+
+		size_t PendingSendsCount()
+		{
+			return transport.PendingSendsCount();
+		}
+
+		DemandSignal SendDemandSignalTo(int target, int amount, int acked = 0, int kind = 0)
+		{
+			DemandSignal msg = DemandSignal();
 
 			msg.target = target;
 			msg.sender = currentRank;
 			msg.amount = amount;
-			MPI_Send(&msg, sizeof(DemandSignal), MPI_BYTE, target, MPI_DSPAR_DEMAND, comm);
+			msg.acked = acked;
+			msg.kind = kind;
+			transport.SendDemand(msg);
 			return msg;
 		}
 
-		AsyncMPIRequest<DemandSignal> SendDemandSignalToAsync(int target, int amount)
+		//report is filled in with the fields of a RATE_REPORT (see DemandSignal), sent as the last one when last is set
+		void SendRateReportTo(int target, DemandSignal report, bool last)
 		{
-			AsyncMPIRequest<DemandSignal> msg;
+			report.target = target;
+			report.sender = currentRank;
+			report.acked = last ? 1 : 0;
+			report.kind = RATE_REPORT;
+			transport.SendDemand(report);
+		}
 
-			msg.data.target = target;
-			msg.data.sender = currentRank;
-			msg.data.amount = amount;
+		//The transport keeps the request until it completes, at the latest in WaitForPendingSends
+		AsyncMPIRequest<DemandSignal> SendDemandSignalToAsync(int target, int amount, int acked = 0)
+		{
+			DemandSignal msg = DemandSignal();
 
-			MPI_Isend(&msg.data, sizeof(DemandSignal), MPI_BYTE, target, MPI_DSPAR_DEMAND, comm, &msg.request);
-			return msg;
+			msg.target = target;
+			msg.sender = currentRank;
+			msg.amount = amount;
+			msg.acked = acked;
+			msg.kind = 0;
+			return transport.SendDemandAsync(msg);
 		}
 
 		template <typename T>
 		AsyncMPIRequest<T> Await(AsyncMPIRequest<T> task)
 		{
-			MPI_Status status;
-			MPI_Wait(&task.request, &status);
+			task.Await();
 			return task;
 		}
 #ifdef DSPARTIMINGS
 		MessageHeader StartSendingMessageTo(int target,
 											uint64_t id = std::numeric_limits<uint64_t>::max(),
 											Duration::rep prev = 0,
-											Timings timings = Timings{0, 0, 0})
+											Timings timings = Timings{0, 0, 0},
+											uint32_t itemCount = 1)
 		{
 			MessageHeader msg;
 			if (id == std::numeric_limits<uint64_t>::max())
@@ -71,6 +226,10 @@ namespace dspar
 			msg.target = target;
 			msg.sender = currentRank;
 			msg.type = MESSAGE_TYPE;
+			msg.partTag = MPI_DSPAR_STREAM_MESSAGE;
+			msg.itemCount = itemCount;
+			msg.framing = FRAME_SEPARATE;
+			msg.payloadBytes = 0;
 
 			msg.totalComputeTime = timings.totalComputeTime;
 
@@ -83,12 +242,12 @@ namespace dspar
 				msg.ts = prev;
 			}
 
-			MPI_Send(&msg, sizeof(msg), MPI_BYTE, target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+			transport.BeginMessage(msg);
 
 			return msg;
 		}
 #else
-		MessageHeader StartSendingMessageTo(int target, uint64_t id = std::numeric_limits<uint64_t>::max())
+		MessageHeader StartSendingMessageTo(int target, uint64_t id = std::numeric_limits<uint64_t>::max(), uint32_t itemCount = 1)
 		{
 			MessageHeader msg;
 			if (id == std::numeric_limits<uint64_t>::max())
@@ -102,8 +261,12 @@ namespace dspar
 			msg.target = target;
 			msg.sender = currentRank;
 			msg.type = MESSAGE_TYPE;
+			msg.partTag = MPI_DSPAR_STREAM_MESSAGE;
+			msg.itemCount = itemCount;
+			msg.framing = FRAME_SEPARATE;
+			msg.payloadBytes = 0;
 
-			MPI_Send(&msg, sizeof(msg), MPI_BYTE, target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+			transport.BeginMessage(msg);
 
 			return msg;
 		}
@@ -123,8 +286,11 @@ namespace dspar
 			msg.target = target;
 			msg.sender = currentRank;
 			msg.type = STOP_TYPE;
-
-			MPI_Send(&msg, sizeof(msg), MPI_BYTE, target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+			msg.partTag = MPI_DSPAR_STREAM_MESSAGE;
+			msg.itemCount = 0;
+			msg.framing = FRAME_SEPARATE;
+			msg.payloadBytes = 0;
+			transport.SendStop(msg);
 			return msg;
 		}
 
@@ -136,7 +302,7 @@ namespace dspar
 			size_t dataSizeInBytes = GetTypeSize<T>();
 			size_t totalBytes = dataSizeInBytes * dimension;
 
-			MPI_Send(buffer, (int)totalBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+			SendBytes(header, buffer, totalBytes);
 		}
 
 		template <typename T>
@@ -152,10 +318,12 @@ namespace dspar
 			size_t dataSizeInBytes = GetTypeSize<T>();
 			size_t totalRowBytes = dataSizeInBytes * dimension2;
 
+			BlockList rows;
 			for (size_t i = 0; i < dimension1; i++)
 			{
-				MPI_Send(buffer[i], (int)totalRowBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+				rows.Add(buffer[i], totalRowBytes);
 			}
+			SendBlocks(header, rows);
 		}
 
 		template <typename T>
@@ -171,13 +339,15 @@ namespace dspar
 			size_t dataSizeInBytes = GetTypeSize<T>();
 			size_t totalRowBytes = dataSizeInBytes * dimension3;
 
-			for (size_t i = 0; i < dimension3; i++)
+			BlockList rows;
+			for (size_t i = 0; i < dimension1; i++)
 			{
-				for (size_t j = 0; j < dimension2; i++)
+				for (size_t j = 0; j < dimension2; j++)
 				{
-					MPI_Send(buffer[i][j], totalRowBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+					rows.Add(buffer[i][j], totalRowBytes);
 				}
 			}
+			SendBlocks(header, rows);
 		}
 
 		template <typename T, size_t I>
@@ -193,7 +363,7 @@ namespace dspar
 
 			size_t totalBytes = sizeof(buffer);
 
-			MPI_Send(buffer, (int)totalBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+			SendBytes(header, buffer, totalBytes);
 		}
 
 		template <typename T, size_t I, size_t J>
@@ -209,7 +379,7 @@ namespace dspar
 
 			size_t totalBytes = sizeof(buffer);
 
-			MPI_Send(buffer, (int)totalBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+			SendBytes(header, buffer, totalBytes);
 		}
 
 		template <typename T>
@@ -224,7 +394,7 @@ namespace dspar
 			SERDE_DEBUG("SendTo(T) Sending data with sizeof T = " << GetTypeSize<T>() << " and sizeof(buffer) = " << sizeof(buffer));
 
 			size_t totalBytes = sizeof(T);
-			MPI_Send(&buffer, (int)totalBytes, MPI_BYTE, header.target, MPI_DSPAR_STREAM_MESSAGE, comm);
+			SendBytes(header, &buffer, totalBytes);
 		}
 
 		template <typename T, size_t I>
@@ -243,12 +413,7 @@ namespace dspar
 
 		void SendTo(const MessageHeader &header, std::string &str)
 		{
-			size_t totalBytes = str.length();
-			SendTo(header, totalBytes);
-			if (totalBytes > 0)
-			{
-				SendTo(header, (char*)str.data(), totalBytes);
-			}
+			SendSized(header, str.length(), str.data(), str.length());
 		}
 
 		template <typename T>
@@ -261,12 +426,7 @@ namespace dspar
 						  "Wrong method call. Passing a T* buffer to this function is forbidden");
 
 			SERDE_DEBUG("SendTo(T) Sending std::vector... Calling SendTo(T*, size_t size)");
-			size_t size = vector.size();
-			SendTo(header, size);
-			if (vector.size() > 0)
-			{
-				SendTo(header, vector.data(), size);
-			}
+			SendSized(header, vector.size(), vector.data(), vector.size() * sizeof(T));
 		}
 
 		/*template <typename T>
@@ -294,19 +454,14 @@ namespace dspar
 						  "Wrong method call. Passing a T* buffer to this function is forbidden");
 
 			std::vector<size_t> sizes;
+			BlockList rows;
 			for (auto &vec : vectors)
 			{
 				sizes.push_back(vec.size());
+				rows.Add(vec.data(), vec.size() * sizeof(T));
 			}
 			SendTo(header, sizes);
-
-			for (auto &vec : vectors)
-			{
-				if (vec.size() > 0)
-				{
-					SendTo(header, vec.data(), vec.size());
-				}
-			}
+			SendBlocks(header, rows);
 		}
 
 		template <typename T>
@@ -318,11 +473,25 @@ namespace dspar
 			static_assert(!std::is_pointer<T>::value,
 						  "Wrong method call. Passing a T* buffer to this function is forbidden");
 
-			SendTo(header, vec3d.size());
+			//row count of every plane followed by the size of every row, then all rows at once
+			std::vector<size_t> shape;
+			BlockList rows;
 			for (auto &vec2d : vec3d)
 			{
-				SendTo(header, vec2d);
+				shape.push_back(vec2d.size());
+			}
+			for (auto &vec2d : vec3d)
+			{
+				for (auto &vec : vec2d)
+				{
+					shape.push_back(vec.size());
+					rows.Add(vec.data(), vec.size() * sizeof(T));
+				}
 			}
+			size_t planes = vec3d.size();
+			SendTo(header, planes);
+			SendTo(header, shape);
+			SendBlocks(header, rows);
 		}
 
 		template <typename T>
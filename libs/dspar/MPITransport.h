@@ -0,0 +1,1368 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <atomic>
+#include "Message.h"
+#include "DemandSignal.h"
+#include "MPIUtils.h"
+#include "AsyncMPIRequest.h"
+#include "StreamChannels.h"
+#include "DatatypeCache.h"
+#include "Transport.h"
+
+namespace dspar
+{
+	//Transport of nodes running as MPI processes. Headers travel as MPI_DSPAR_MESSAGE_BOUNDARY messages with the
+	//payload inline, in a tail message or in one message per part (see the FRAME_* flags), or through the rings
+	//of StreamChannels. The options are set through MPISender and MPIReceiver.
+	//Headers are taken with a matched probe and the parts after them are matched by sender and the item's
+	//partTag, so with MPI_THREAD_MULTIPLE several threads of a rank may each receive items through their own
+	//transport. Prefetching works per transport; the rings of StreamChannels have a single reader per rank.
+	class MPITransport : public Transport
+	{
+	private:
+		MPI_Comm comm;
+
+		//rings replacing two-sided MPI for some sources and targets
+		StreamChannels *channels;
+
+		//Preallocated buffer bound to a persistent request (MPI_Send_init or MPI_Recv_init)
+		struct PersistentSlot
+		{
+			std::vector<char> buffer;
+			MPI_Request request;
+		};
+
+		//---- sending
+
+		bool singleBufferFraming;
+		//true between BeginMessage and FinishMessage when packing
+		bool packing;
+		//packed message: space for the MessageHeader followed by the payload
+		std::vector<char> packedMessage;
+
+		//items whose payload stays under this size go inline with the header even without single buffer framing
+		size_t eagerPayloadBytes;
+		//true while packing an item that falls back to separate framing if it grows past eagerPayloadBytes
+		bool eager;
+		//sizes of the parts kept so far, each becomes its own message on fallback
+		std::vector<size_t> eagerParts;
+
+		//ring of the record being written, NULL when the current item goes through MPI
+		StreamRing *ringRecord;
+		uint64_t ringRecordStart;
+		uint64_t ringPosition;
+		//the item did not fit the ring, its payload continues in packedMessage
+		bool ringOverflow;
+
+		//Requests of one emitted item and the buffers they read from, kept alive until completion
+		struct InFlightMessage
+		{
+			std::vector<std::vector<char>> buffers;
+			std::vector<MPI_Request> requests;
+		};
+
+		//0 means blocking MPI_Send, otherwise the number of items that may be in flight per target
+		int maxInFlightSendsPerTarget;
+		InFlightMessage currentMessage;
+		std::map<int, std::deque<InFlightMessage>> inFlightMessages;
+		std::vector<std::vector<char>> recycledBuffers;
+
+		//datatypes of multi-dimensional structures sent with separate framing
+		BlockDatatypeCache sendTypes;
+
+		struct PersistentEdge
+		{
+			std::vector<PersistentSlot> slots;
+			size_t next = 0;
+		};
+
+		//size of the parts sent through persistent requests, 0 when disabled
+		size_t persistentSendBytes;
+		std::map<int, PersistentEdge> persistentEdges;
+
+		//demand signals posted by SendDemandAsync, all completed by WaitForPendingSends
+		std::deque<AsyncMPIRequest<DemandSignal>> pendingDemands;
+
+		//---- receiving
+
+		//datatypes of multi-dimensional structures received with separate framing
+		BlockDatatypeCache receiveTypes;
+
+		//size of the parts received through persistent requests, 0 when disabled
+		size_t persistentReceiveBytes;
+		//every item is one part of this size (see SetFixedWireSize), 0 when unknown
+		size_t fixedPartBytes;
+		std::map<int, PersistentSlot> persistentReceives;
+
+		//small segmented item received in one message with its prefix, read through packedCursor,
+		//or a combined size and data message of ReceiveSized
+		std::vector<char> segmentMessage;
+		bool segmentsInPrefixMessage;
+
+		size_t nextRing;
+		//ring record being read, released when the next message is requested
+		StreamRing *currentRing;
+		uint64_t ringCursor;
+		uint64_t ringEnd;
+		uint64_t ringRecordEnd;
+
+		//header message as received, with room for an inline payload
+		std::vector<char> headerMessage;
+		//payload received in a separate message for FRAME_PACKED_TAIL items
+		std::vector<char> tailPayload;
+
+		//read position inside the packed payload of the current item
+		const char *packedCursor;
+		const char *packedEnd;
+
+		//A header receive posted ahead of time, plus the payload receive of FRAME_PACKED_TAIL items
+		struct PrefetchSlot
+		{
+			std::vector<char> message;
+			MPI_Request request;
+			MPI_Status status;
+			bool arrived;
+
+			std::vector<char> tail;
+			std::vector<MPI_Request> tailRequests;
+			bool tailPosted;
+		};
+
+		std::vector<PrefetchSlot> prefetchSlots;
+		bool prefetchPayloads;
+		bool prefetchStarted;
+		//slot holding the item being processed, reposted when the next item is requested
+		int consumedSlot;
+		size_t nextSlot;
+
+		std::vector<char> TakeBuffer()
+		{
+			if (recycledBuffers.empty())
+			{
+				return std::vector<char>();
+			}
+			std::vector<char> buffer = std::move(recycledBuffers.back());
+			recycledBuffers.pop_back();
+			buffer.clear();
+			return buffer;
+		}
+
+		void Recycle(InFlightMessage &message)
+		{
+			for (auto &buffer : message.buffers)
+			{
+				if (recycledBuffers.size() < (size_t)maxInFlightSendsPerTarget)
+				{
+					recycledBuffers.push_back(std::move(buffer));
+				}
+			}
+		}
+
+		//Posts one MPI_Isend per chunk of the part, a single one when it fits a chunk
+		void PostChunks(int target, int tag, const char *data, size_t bytes, std::vector<MPI_Request> &requests)
+		{
+			size_t chunk = globals::chunkBytes;
+			size_t offset = 0;
+			do
+			{
+				MPI_Request request;
+				MPI_Isend(data + offset, (int)std::min(chunk, bytes - offset), MPI_BYTE, target, tag, comm, &request);
+				requests.push_back(request);
+				offset += chunk;
+			} while (offset < bytes);
+		}
+
+		//Posts the sends of one chunk of a block list, described by a datatype when it spans several blocks
+		void PostBlocks(int target, int tag, const BlockList &chunk, std::vector<MPI_Request> &requests)
+		{
+			MPI_Request request;
+			if (chunk.blocks.size() == 1)
+			{
+				MPI_Isend(chunk.blocks[0], (int)chunk.totalBytes, MPI_BYTE, target, tag, comm, &request);
+			}
+			else
+			{
+				BlockDatatype type = sendTypes.Get(chunk.lengths, chunk.Displacements());
+				MPI_Isend(chunk.blocks[0], 1, type, target, tag, comm, &request);
+			}
+			requests.push_back(request);
+		}
+
+		void PostSend(int target, int tag, const char *data, size_t bytes)
+		{
+			PostChunks(target, tag, data, bytes, currentMessage.requests);
+		}
+
+		//Blocking send of one part. Parts larger than a chunk are sent as chunks whose transfers overlap.
+		void SendNow(int target, int tag, const void *data, size_t bytes)
+		{
+			if (bytes <= globals::chunkBytes)
+			{
+				MPI_Send(data, (int)bytes, MPI_BYTE, target, tag, comm);
+				return;
+			}
+			std::vector<MPI_Request> requests;
+			PostChunks(target, tag, (const char *)data, bytes, requests);
+			MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+		}
+
+		//Copies the part to the next staging slot of the edge and starts its request, once the
+		//previous send from that slot completed. Slots are set up the first time the edge is used.
+		void StartPersistentSend(int target, const void *data, size_t bytes)
+		{
+			PersistentEdge &edge = persistentEdges[target];
+			if (edge.slots.empty())
+			{
+				edge.slots.resize(DSPAR_PERSISTENT_SLOTS);
+				for (auto &slot : edge.slots)
+				{
+					slot.buffer.resize(bytes);
+					MPI_Send_init(slot.buffer.data(), (int)bytes, MPI_BYTE, target, MPI_DSPAR_STREAM_MESSAGE, comm, &slot.request);
+				}
+			}
+			PersistentSlot &slot = edge.slots[edge.next];
+			edge.next = (edge.next + 1) % edge.slots.size();
+			MPI_Wait(&slot.request, MPI_STATUS_IGNORE);
+			memcpy(slot.buffer.data(), data, bytes);
+			MPI_Start(&slot.request);
+		}
+
+		void FreePersistentSends()
+		{
+			for (auto &edge : persistentEdges)
+			{
+				for (auto &slot : edge.second.slots)
+				{
+					MPI_Wait(&slot.request, MPI_STATUS_IGNORE);
+					MPI_Request_free(&slot.request);
+				}
+			}
+			persistentEdges.clear();
+		}
+
+		void SendOrPost(int target, int tag, const void *data, size_t bytes)
+		{
+			if (tag == MPI_DSPAR_STREAM_MESSAGE && bytes == persistentSendBytes && bytes > 0)
+			{
+				StartPersistentSend(target, data, bytes);
+				return;
+			}
+			if (maxInFlightSendsPerTarget == 0)
+			{
+				SendNow(target, tag, data, bytes);
+				return;
+			}
+			std::vector<char> buffer = TakeBuffer();
+			buffer.assign((const char *)data, (const char *)data + bytes);
+			PostSend(target, tag, buffer.data(), bytes);
+			currentMessage.buffers.push_back(std::move(buffer));
+		}
+
+		//Sends a buffer built for one part, keeping it for reuse or until its asynchronous send completes
+		void SendGathered(const MessageHeader &header, std::vector<char> &&buffer)
+		{
+			if (maxInFlightSendsPerTarget == 0)
+			{
+				SendNow(header.target, header.partTag, buffer.data(), buffer.size());
+				recycledBuffers.push_back(std::move(buffer));
+				return;
+			}
+			PostSend(header.target, header.partTag, buffer.data(), buffer.size());
+			currentMessage.buffers.push_back(std::move(buffer));
+		}
+
+		static uint64_t AlignRecord(uint64_t bytes)
+		{
+			return (bytes + 7) & ~(uint64_t)7;
+		}
+
+		//Makes the record visible to the receiver, its payload must already be in the ring
+		void PublishRingRecord(StreamRing &ring, uint64_t start, MessageHeader &header, uint64_t payloadBytes)
+		{
+			uint64_t recordBytes = AlignRecord(RING_RECORD_PREFIX + payloadBytes);
+			ring.WaitForSpace(start + recordBytes);
+			ring.CopyIn(start, &recordBytes, sizeof(uint64_t));
+			ring.CopyIn(start + sizeof(uint64_t), &header, sizeof(MessageHeader));
+			ring.Publish(start + recordBytes);
+		}
+
+		void SendRingRecord(MessageHeader &header)
+		{
+			StreamRing &ring = *ringRecord;
+			ringRecord = NULL;
+			if (ringOverflow)
+			{
+				header.framing = FRAME_PACKED_TAIL;
+				header.payloadBytes = packedMessage.size() - sizeof(MessageHeader);
+				PublishRingRecord(ring, ringRecordStart, header, 0);
+				SendNow(header.target, header.partTag, packedMessage.data() + sizeof(MessageHeader), header.payloadBytes);
+				return;
+			}
+			header.framing = FRAME_RING;
+			header.payloadBytes = ringPosition - ringRecordStart - RING_RECORD_PREFIX;
+			PublishRingRecord(ring, ringRecordStart, header, header.payloadBytes);
+		}
+
+		void WriteToRing(const void *buffer, size_t bytes)
+		{
+			StreamRing &ring = *ringRecord;
+			if (!ringOverflow && AlignRecord(ringPosition + bytes - ringRecordStart) > ring.capacity)
+			{
+				//larger than the ring, the bytes written so far move to the MPI tail
+				uint64_t written = ringPosition - ringRecordStart - RING_RECORD_PREFIX;
+				packedMessage.resize(sizeof(MessageHeader) + written);
+				ring.CopyOut(ringRecordStart + RING_RECORD_PREFIX, packedMessage.data() + sizeof(MessageHeader), written);
+				ringOverflow = true;
+			}
+			if (ringOverflow)
+			{
+				const char *data = (const char *)buffer;
+				packedMessage.insert(packedMessage.end(), data, data + bytes);
+				return;
+			}
+			ring.WaitForSpace(ringPosition + bytes);
+			ring.CopyIn(ringPosition, buffer, bytes);
+			ringPosition += bytes;
+		}
+
+		//Keeps the next part of an eager item, or sends the item so far with separate framing when it gets too large
+		bool KeepEagerPart(const MessageHeader &header, size_t bytes)
+		{
+			if (packedMessage.size() - sizeof(MessageHeader) + bytes <= eagerPayloadBytes)
+			{
+				eagerParts.push_back(bytes);
+				return true;
+			}
+
+			packing = false;
+			eager = false;
+			MessageHeader separate = header;
+			separate.framing = FRAME_SEPARATE;
+			separate.payloadBytes = 0;
+			SendOrPost(header.target, MPI_DSPAR_MESSAGE_BOUNDARY, &separate, sizeof(separate));
+			size_t offset = sizeof(MessageHeader);
+			for (size_t part : eagerParts)
+			{
+				SendOrPost(header.target, header.partTag, packedMessage.data() + offset, part);
+				offset += part;
+			}
+			return false;
+		}
+
+		void SendPackedMessage(MessageHeader &header)
+		{
+			size_t payloadBytes = packedMessage.size() - sizeof(MessageHeader);
+			header.payloadBytes = payloadBytes;
+			header.framing = payloadBytes <= DSPAR_INLINE_PAYLOAD_CAPACITY ? FRAME_INLINE : FRAME_PACKED_TAIL;
+			memcpy(packedMessage.data(), &header, sizeof(MessageHeader));
+
+			if (maxInFlightSendsPerTarget == 0)
+			{
+				if (header.framing == FRAME_INLINE)
+				{
+					MPI_Send(packedMessage.data(), (int)packedMessage.size(), MPI_BYTE, header.target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+				}
+				else
+				{
+					MPI_Send(packedMessage.data(), sizeof(MessageHeader), MPI_BYTE, header.target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+					SendNow(header.target, header.partTag, packedMessage.data() + sizeof(MessageHeader), payloadBytes);
+				}
+				return;
+			}
+
+			if (header.framing == FRAME_INLINE)
+			{
+				PostSend(header.target, MPI_DSPAR_MESSAGE_BOUNDARY, packedMessage.data(), packedMessage.size());
+			}
+			else
+			{
+				PostSend(header.target, MPI_DSPAR_MESSAGE_BOUNDARY, packedMessage.data(), sizeof(MessageHeader));
+				PostSend(header.target, header.partTag, packedMessage.data() + sizeof(MessageHeader), payloadBytes);
+			}
+			//the buffer now belongs to the in-flight message, moving keeps its data pointer valid
+			currentMessage.buffers.push_back(std::move(packedMessage));
+			packedMessage = TakeBuffer();
+		}
+
+		void ReapCompletedDemands()
+		{
+			while (!pendingDemands.empty() && pendingDemands.front().Test())
+			{
+				pendingDemands.pop_front();
+			}
+		}
+
+		void PostSlot(PrefetchSlot &slot)
+		{
+			slot.arrived = false;
+			slot.tailPosted = false;
+			MPI_Irecv(slot.message.data(), (int)slot.message.size(), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, &slot.request);
+		}
+
+		MessageHeader ReadHeader(char *message, int source)
+		{
+			MessageHeader header;
+			memcpy(&header, message, sizeof(MessageHeader));
+			header.sender = source;
+
+			if (header.framing == FRAME_INLINE)
+			{
+				packedCursor = message + sizeof(MessageHeader);
+				packedEnd = packedCursor + header.payloadBytes;
+			}
+			return header;
+		}
+
+		void SetPackedTail(std::vector<char> &tail)
+		{
+			packedCursor = tail.data();
+			packedEnd = packedCursor + tail.size();
+		}
+
+		//Items sent with separate framing whose parts can be received before they are read, knowing their size
+		bool HasFixedParts(const MessageHeader &header)
+		{
+			return fixedPartBytes > 0 && header.framing == FRAME_SEPARATE && header.type == MESSAGE_TYPE;
+		}
+
+		//Posts the payload receives of a prefetched header into its slot: the packed tail,
+		//or the fixed-size part of every item of a separately framed message
+		void PostSlotPayload(PrefetchSlot &slot, const MessageHeader &header, int source)
+		{
+			slot.tailRequests.clear();
+			if (header.framing == FRAME_PACKED_TAIL)
+			{
+				slot.tail.resize(header.payloadBytes);
+				PostChunkReceives(source, header.partTag, slot.tail.data(), header.payloadBytes, slot.tailRequests);
+			}
+			else
+			{
+				size_t parts = header.itemCount > 0 ? header.itemCount : 1;
+				slot.tail.resize(parts * fixedPartBytes);
+				for (size_t i = 0; i < parts; i++)
+				{
+					PostChunkReceives(source, header.partTag, slot.tail.data() + i * fixedPartBytes, fixedPartBytes, slot.tailRequests);
+				}
+			}
+			slot.tailPosted = true;
+		}
+
+		//Posts the payload receives of headers that already arrived behind the current one. A sender whose
+		//earlier item uses separate framing, with parts of unknown size under the same tag, is skipped: those
+		//parts must be received first.
+		void PrefetchUpcomingPayloads()
+		{
+			std::vector<std::pair<int, int>> blockedSenders;
+			MessageHeader current;
+			memcpy(&current, prefetchSlots[consumedSlot].message.data(), sizeof(MessageHeader));
+			if (current.framing == FRAME_SEPARATE && !prefetchSlots[consumedSlot].tailPosted)
+			{
+				blockedSenders.push_back(std::make_pair(prefetchSlots[consumedSlot].status.MPI_SOURCE, current.partTag));
+			}
+
+			for (size_t i = 1; i < prefetchSlots.size(); i++)
+			{
+				PrefetchSlot &slot = prefetchSlots[(consumedSlot + i) % prefetchSlots.size()];
+				if (!slot.arrived)
+				{
+					int arrived = 0;
+					MPI_Test(&slot.request, &arrived, &slot.status);
+					if (!arrived)
+					{
+						return;
+					}
+					slot.arrived = true;
+				}
+
+				MessageHeader header;
+				memcpy(&header, slot.message.data(), sizeof(MessageHeader));
+				int source = slot.status.MPI_SOURCE;
+				auto sourceAndTag = std::make_pair(source, header.partTag);
+				bool blocked = std::find(blockedSenders.begin(), blockedSenders.end(), sourceAndTag) != blockedSenders.end();
+
+				if ((header.framing == FRAME_PACKED_TAIL || HasFixedParts(header)) && !slot.tailPosted && !blocked)
+				{
+					PostSlotPayload(slot, header, source);
+				}
+				if (header.framing == FRAME_SEPARATE && !slot.tailPosted)
+				{
+					blockedSenders.push_back(sourceAndTag);
+				}
+			}
+		}
+
+		MessageHeader ReceivePrefetchedMessage()
+		{
+			if (!prefetchStarted)
+			{
+				for (auto &slot : prefetchSlots)
+				{
+					PostSlot(slot);
+				}
+				prefetchStarted = true;
+			}
+			else if (consumedSlot >= 0)
+			{
+				PostSlot(prefetchSlots[consumedSlot]);
+			}
+
+			PrefetchSlot &slot = prefetchSlots[nextSlot];
+			consumedSlot = (int)nextSlot;
+			nextSlot = (nextSlot + 1) % prefetchSlots.size();
+
+			if (!slot.arrived)
+			{
+				MPI_Wait(&slot.request, &slot.status);
+				slot.arrived = true;
+			}
+
+			MessageHeader header = ReadHeader(slot.message.data(), slot.status.MPI_SOURCE);
+
+			if (header.framing == FRAME_PACKED_TAIL)
+			{
+				if (slot.tailPosted)
+				{
+					MPI_Waitall((int)slot.tailRequests.size(), slot.tailRequests.data(), MPI_STATUSES_IGNORE);
+				}
+				else
+				{
+					slot.tail.resize(header.payloadBytes);
+					ReceivePart(header.sender, header.partTag, slot.tail.data(), header.payloadBytes);
+				}
+				SetPackedTail(slot.tail);
+			}
+			else if (header.framing == FRAME_SEPARATE && slot.tailPosted)
+			{
+				//the fixed-size parts were prefetched, the item is read from the slot like a packed tail
+				MPI_Waitall((int)slot.tailRequests.size(), slot.tailRequests.data(), MPI_STATUSES_IGNORE);
+				header.framing = FRAME_PACKED_TAIL;
+				header.payloadBytes = slot.tail.size();
+				SetPackedTail(slot.tail);
+			}
+
+			if (prefetchPayloads)
+			{
+				PrefetchUpcomingPayloads();
+			}
+			return header;
+		}
+
+		//Receives the part through the persistent request of its source, set up the first time
+		void ReceivePersistent(int source, void *buffer, size_t bytes)
+		{
+			auto it = persistentReceives.find(source);
+			if (it == persistentReceives.end())
+			{
+				PersistentSlot &slot = persistentReceives[source];
+				slot.buffer.resize(bytes);
+				MPI_Recv_init(slot.buffer.data(), (int)bytes, MPI_BYTE, source, MPI_DSPAR_STREAM_MESSAGE, comm, &slot.request);
+				it = persistentReceives.find(source);
+			}
+			PersistentSlot &slot = it->second;
+			MPI_Status status;
+			MPI_Start(&slot.request);
+			MPI_Wait(&slot.request, &status);
+			CheckReceivedSize(status, bytes);
+			memcpy(buffer, slot.buffer.data(), bytes);
+		}
+
+		void FreePersistentReceives()
+		{
+			for (auto &entry : persistentReceives)
+			{
+				MPI_Request_free(&entry.second.request);
+			}
+			persistentReceives.clear();
+		}
+
+		//Posts one MPI_Irecv per chunk of the part, matching PostChunks of the sender
+		void PostChunkReceives(int source, int tag, char *buffer, size_t bytes, std::vector<MPI_Request> &requests)
+		{
+			size_t chunk = globals::chunkBytes;
+			size_t offset = 0;
+			do
+			{
+				MPI_Request request;
+				MPI_Irecv(buffer + offset, (int)std::min(chunk, bytes - offset), MPI_BYTE, source, tag, comm, &request);
+				requests.push_back(request);
+				offset += chunk;
+			} while (offset < bytes);
+		}
+
+		void PostBlockReceives(int source, int tag, const BlockList &chunk, std::vector<MPI_Request> &requests)
+		{
+			MPI_Request request;
+			if (chunk.blocks.size() == 1)
+			{
+				MPI_Irecv(chunk.blocks[0], (int)chunk.totalBytes, MPI_BYTE, source, tag, comm, &request);
+			}
+			else
+			{
+				BlockDatatype type = receiveTypes.Get(chunk.lengths, chunk.Displacements());
+				MPI_Irecv(chunk.blocks[0], 1, type, source, tag, comm, &request);
+			}
+			requests.push_back(request);
+		}
+
+		//Receives chunks posted together, each of them must have its full size
+		void WaitForChunks(std::vector<MPI_Request> &requests, size_t bytes)
+		{
+			std::vector<MPI_Status> statuses(requests.size());
+			MPI_Waitall((int)requests.size(), requests.data(), statuses.data());
+			for (size_t i = 0; i < statuses.size(); i++)
+			{
+				CheckReceivedSize(statuses[i], std::min((size_t)globals::chunkBytes, bytes - i * globals::chunkBytes));
+			}
+		}
+
+		//Receives one payload part from source, as chunks whose transfers overlap when it is larger than a chunk
+		void ReceivePart(int source, int tag, void *buffer, size_t bytes)
+		{
+			if (bytes <= globals::chunkBytes)
+			{
+				MPI_Status status;
+				MPI_Recv(buffer, (int)bytes, MPI_BYTE, source, tag, comm, &status);
+				CheckReceivedSize(status, bytes);
+				return;
+			}
+			std::vector<MPI_Request> requests;
+			PostChunkReceives(source, tag, (char *)buffer, bytes, requests);
+			WaitForChunks(requests, bytes);
+		}
+
+		//The size of a part is trusted: its receive is posted right away. Building with DSPAR_VALIDATE_SIZES
+		//probes the message (the first chunk of large parts) and reports a mismatch before receiving.
+#ifdef DSPAR_VALIDATE_SIZES
+		void ProbeSize(MessageHeader &header, size_t bytes)
+		{
+			MPI_Status status;
+			MPI_Probe(header.sender, header.partTag, comm, &status);
+			CheckReceivedSize(status, std::min(bytes, (size_t)globals::chunkBytes));
+		}
+#else
+		void ProbeSize(MessageHeader &, size_t)
+		{
+		}
+#endif
+
+		//A longer message already failed the receive, this catches shorter ones
+		void CheckReceivedSize(MPI_Status &status, size_t bytes)
+		{
+			int count;
+			MPI_Get_count(&status, MPI_BYTE, &count);
+			if (count != (int)bytes)
+			{
+				SERDE_ERROR("Send and receives of wrong size. Got " << count << " bytes, expected to receive " << bytes << ". Aborting to prevent errors");
+				MPI_Abort(comm, 1);
+			}
+		}
+
+		void ReleaseRingRecord()
+		{
+			if (currentRing != NULL)
+			{
+				currentRing->Release(ringRecordEnd);
+				currentRing = NULL;
+			}
+		}
+
+		MessageHeader ReadRingRecord(StreamRing &ring, uint64_t start)
+		{
+			uint64_t recordBytes;
+			MessageHeader header;
+			ring.CopyOut(start, &recordBytes, sizeof(uint64_t));
+			ring.CopyOut(start + sizeof(uint64_t), &header, sizeof(MessageHeader));
+			currentRing = &ring;
+			ringRecordEnd = start + recordBytes;
+			ringCursor = start + RING_RECORD_PREFIX;
+			ringEnd = ringCursor + header.payloadBytes;
+
+			if (header.framing == FRAME_PACKED_TAIL)
+			{
+				//too large for the ring, the payload follows through MPI
+				ReleaseRingRecord();
+				tailPayload.resize(header.payloadBytes);
+				ReceivePart(header.sender, header.partTag, tailPayload.data(), header.payloadBytes);
+				SetPackedTail(tailPayload);
+			}
+			return header;
+		}
+
+		bool RingHasRecord(StreamRing &ring)
+		{
+			//the record being read is released by the next ReceiveHeader, it is not waiting
+			uint64_t unread = &ring == currentRing ? ringRecordEnd : ring.Tail();
+			return ring.Head() != unread;
+		}
+
+		//Polls the rings round robin, and MPI when some source runs on another host
+		MessageHeader ReceiveFromRingsOrMPI()
+		{
+			std::vector<StreamRing *> &rings = channels->InboundRings();
+			while (true)
+			{
+				for (size_t i = 0; i < rings.size(); i++)
+				{
+					StreamRing &ring = *rings[(nextRing + i) % rings.size()];
+					if (RingHasRecord(ring))
+					{
+						nextRing = (nextRing + i + 1) % rings.size();
+						return ReadRingRecord(ring, ring.Tail());
+					}
+				}
+				if (channels->HasRemoteSources() && HasMPIMessageWaiting())
+				{
+					return ReceiveMPIMessage();
+				}
+				std::this_thread::yield();
+			}
+		}
+
+		//Tag of the parts of the next item. With MPI_THREAD_MULTIPLE several threads of the target may take
+		//headers from this rank, so each item gets its own tag, cycling up to MPI_TAG_UB over the items sent by
+		//every thread of this process: only the thread holding the header matches the parts of its item.
+		int NextPartTag()
+		{
+			if (!globals::threadMultiple)
+			{
+				return MPI_DSPAR_STREAM_MESSAGE;
+			}
+			static std::atomic<uint32_t> nextItem(0);
+			static const uint32_t tags = PartTagCount();
+			return MPI_DSPAR_FIRST_PART_TAG + (int)(nextItem++ % tags);
+		}
+
+		uint32_t PartTagCount()
+		{
+			int *upperBound;
+			int found = 0;
+			MPI_Comm_get_attr(comm, MPI_TAG_UB, &upperBound, &found);
+			//the standard guarantees at least 32767
+			int last = found ? *upperBound : 32767;
+			return (uint32_t)(last - MPI_DSPAR_FIRST_PART_TAG + 1);
+		}
+
+		//The header is taken with a matched probe, so no other thread receiving on this rank can get it. The
+		//receive state of the item (packed cursor, tail, segment message) belongs to this transport, and the
+		//parts that follow are matched by sender and partTag without locking.
+		MessageHeader ReceiveMPIMessage()
+		{
+			if (!prefetchSlots.empty())
+			{
+				return ReceivePrefetchedMessage();
+			}
+
+			MPI_Message message;
+			MPI_Status status;
+			MPI_Mprobe(MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, &message, &status);
+			MPI_Mrecv(headerMessage.data(), (int)headerMessage.size(), MPI_BYTE, &message, &status);
+			MessageHeader header = ReadHeader(headerMessage.data(), status.MPI_SOURCE);
+
+			if (header.framing == FRAME_PACKED_TAIL)
+			{
+				tailPayload.resize(header.payloadBytes);
+				ReceivePart(header.sender, header.partTag, tailPayload.data(), header.payloadBytes);
+				SetPackedTail(tailPayload);
+			}
+			return header;
+		}
+
+		bool HasMPIMessageWaiting()
+		{
+			int flag = 0;
+			if (prefetchStarted && (int)nextSlot != consumedSlot)
+			{
+				PrefetchSlot &slot = prefetchSlots[nextSlot];
+				if (!slot.arrived)
+				{
+					MPI_Test(&slot.request, &flag, &slot.status);
+					slot.arrived = flag != 0;
+				}
+				return slot.arrived;
+			}
+			MPI_Iprobe(MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, &flag, MPI_STATUS_IGNORE);
+			return flag != 0;
+		}
+
+	public:
+		MPITransport(MPI_Comm _comm) : comm(_comm), channels(NULL), singleBufferFraming(false), packing(false), eagerPayloadBytes(0), eager(false),
+									   ringRecord(NULL), maxInFlightSendsPerTarget(0), persistentSendBytes(0),
+									   persistentReceiveBytes(0), fixedPartBytes(0), segmentsInPrefixMessage(false), nextRing(0), currentRing(NULL),
+									   headerMessage(sizeof(MessageHeader) + DSPAR_INLINE_PAYLOAD_CAPACITY), packedCursor(NULL), packedEnd(NULL),
+									   prefetchPayloads(false), prefetchStarted(false), consumedSlot(-1), nextSlot(0) {}
+
+		int GetMyRank() override
+		{
+			int rank;
+			MPI_Comm_rank(comm, &rank);
+			return rank;
+		}
+
+		int GetSize() override
+		{
+			int size;
+			MPI_Comm_size(comm, &size);
+			return size;
+		}
+
+		void Barrier() override
+		{
+			MPI_Barrier(comm);
+		}
+
+		void SetSingleBufferFraming(bool enabled) override
+		{
+			singleBufferFraming = enabled;
+		}
+
+		void SetStreamChannels(StreamChannels *_channels) override
+		{
+			channels = _channels;
+		}
+
+		void SetEagerPayloadThreshold(size_t bytes) override
+		{
+			eagerPayloadBytes = std::min(bytes, (size_t)DSPAR_INLINE_PAYLOAD_CAPACITY);
+		}
+
+		void SetPersistentPartSize(size_t bytes) override
+		{
+			FreePersistentSends();
+			persistentSendBytes = bytes <= globals::chunkBytes ? bytes : 0;
+		}
+
+		void SetMaxInFlightSendsPerTarget(int maxInFlight) override
+		{
+			WaitForPendingSends();
+			maxInFlightSendsPerTarget = maxInFlight > 0 ? maxInFlight : 0;
+		}
+
+		void SetPrefetchDepth(int depth, bool _prefetchPayloads) override
+		{
+			StopReceiving();
+			prefetchPayloads = _prefetchPayloads;
+			prefetchSlots.resize(depth > 0 ? depth : 0);
+			for (auto &slot : prefetchSlots)
+			{
+				slot.message.resize(sizeof(MessageHeader) + DSPAR_INLINE_PAYLOAD_CAPACITY);
+			}
+		}
+
+		void SetFixedWireSize(size_t bytes) override
+		{
+			FreePersistentReceives();
+			persistentReceiveBytes = bytes <= DSPAR_SEGMENT_COPY_THRESHOLD ? bytes : 0;
+			fixedPartBytes = bytes;
+		}
+
+		void BeginMessage(MessageHeader &header) override
+		{
+			header.partTag = NextPartTag();
+			if (channels != NULL && (ringRecord = channels->OutboundRing(header.target)) != NULL)
+			{
+				ringRecordStart = ringRecord->Head();
+				ringPosition = ringRecordStart + RING_RECORD_PREFIX;
+				ringOverflow = false;
+				return;
+			}
+
+			if (maxInFlightSendsPerTarget > 0)
+			{
+				ReapCompletedSends();
+			}
+
+			if (singleBufferFraming)
+			{
+				packing = true;
+				packedMessage.resize(sizeof(MessageHeader));
+			}
+			else if (eagerPayloadBytes > 0)
+			{
+				//the header is sent once we know whether the payload fits in it
+				packing = true;
+				eager = true;
+				packedMessage.resize(sizeof(MessageHeader));
+				eagerParts.clear();
+			}
+			else
+			{
+				MessageHeader separate = header;
+				separate.framing = FRAME_SEPARATE;
+				separate.payloadBytes = 0;
+				SendOrPost(header.target, MPI_DSPAR_MESSAGE_BOUNDARY, &separate, sizeof(separate));
+			}
+		}
+
+		void SendBytes(const MessageHeader &header, const void *buffer, size_t bytes) override
+		{
+			if (ringRecord != NULL)
+			{
+				WriteToRing(buffer, bytes);
+			}
+			else if (packing && (!eager || KeepEagerPart(header, bytes)))
+			{
+				const char *data = (const char *)buffer;
+				packedMessage.insert(packedMessage.end(), data, data + bytes);
+			}
+			else
+			{
+				SendOrPost(header.target, header.partTag, buffer, bytes);
+			}
+		}
+
+		//With separate framing the blocks go in a single MPI message described by a cached datatype,
+		//otherwise they are appended to the packed buffer or ring
+		void SendBlocks(const MessageHeader &header, const BlockList &list) override
+		{
+			if (list.blocks.empty())
+			{
+				return;
+			}
+			if (ringRecord != NULL || (packing && !eager))
+			{
+				Transport::SendBlocks(header, list);
+				return;
+			}
+			if (packing && KeepEagerPart(header, list.totalBytes))
+			{
+				//one part, the receiver reads all blocks together on fallback
+				for (size_t i = 0; i < list.blocks.size(); i++)
+				{
+					packedMessage.insert(packedMessage.end(), list.blocks[i], list.blocks[i] + list.lengths[i]);
+				}
+				return;
+			}
+			if (maxInFlightSendsPerTarget > 0)
+			{
+				//the copy kept for the asynchronous send gathers the blocks anyway
+				std::vector<char> buffer = TakeBuffer();
+				for (size_t i = 0; i < list.blocks.size(); i++)
+				{
+					buffer.insert(buffer.end(), list.blocks[i], list.blocks[i] + list.lengths[i]);
+				}
+				PostSend(header.target, header.partTag, buffer.data(), buffer.size());
+				currentMessage.buffers.push_back(std::move(buffer));
+				return;
+			}
+			if (list.totalBytes <= globals::chunkBytes)
+			{
+				BlockDatatype type = sendTypes.Get(list.lengths, list.Displacements());
+				MPI_Send(list.blocks[0], 1, type, header.target, header.partTag, comm);
+				return;
+			}
+			std::vector<MPI_Request> requests;
+			for (const BlockList &chunk : list.Split(globals::chunkBytes))
+			{
+				PostBlocks(header.target, header.partTag, chunk, requests);
+			}
+			MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+		}
+
+		//With separate framing small items are copied into one message, larger ones go as the prefix plus one datatype message
+		void SendSegments(const MessageHeader &header, const void *prefix, size_t prefixBytes, const BlockList &segments) override
+		{
+			if (ringRecord != NULL || packing)
+			{
+				Transport::SendSegments(header, prefix, prefixBytes, segments);
+				return;
+			}
+			if (prefixBytes + segments.totalBytes > DSPAR_SEGMENT_COPY_THRESHOLD)
+			{
+				SendOrPost(header.target, header.partTag, prefix, prefixBytes);
+				SendBlocks(header, segments);
+				return;
+			}
+
+			std::vector<char> buffer = TakeBuffer();
+			buffer.assign((const char *)prefix, (const char *)prefix + prefixBytes);
+			for (size_t i = 0; i < segments.blocks.size(); i++)
+			{
+				buffer.insert(buffer.end(), segments.blocks[i], segments.blocks[i] + segments.lengths[i]);
+			}
+			SendGathered(header, std::move(buffer));
+		}
+
+		//With separate framing, small payloads go as one message of size and data; larger ones as the size
+		//then the data, which the receiver gets without probing
+		void SendSized(const MessageHeader &header, size_t count, const void *data, size_t bytes) override
+		{
+			if (ringRecord != NULL || packing || count == 0 || bytes > DSPAR_SEGMENT_COPY_THRESHOLD)
+			{
+				Transport::SendSized(header, count, data, bytes);
+				return;
+			}
+
+			std::vector<char> buffer = TakeBuffer();
+			buffer.assign((const char *)&count, (const char *)&count + sizeof(size_t));
+			buffer.insert(buffer.end(), (const char *)data, (const char *)data + bytes);
+			SendGathered(header, std::move(buffer));
+		}
+
+		//Sends the packed buffer when packing, and tracks the item's requests when sending asynchronously
+		void FinishMessage(MessageHeader &header) override
+		{
+			if (ringRecord != NULL)
+			{
+				SendRingRecord(header);
+				return;
+			}
+
+			if (packing)
+			{
+				packing = false;
+				eager = false;
+				SendPackedMessage(header);
+			}
+
+			if (maxInFlightSendsPerTarget == 0)
+			{
+				return;
+			}
+
+			std::deque<InFlightMessage> &queue = inFlightMessages[header.target];
+			queue.push_back(std::move(currentMessage));
+			currentMessage = InFlightMessage();
+
+			while (queue.size() > (size_t)maxInFlightSendsPerTarget)
+			{
+				InFlightMessage &oldest = queue.front();
+				MPI_Waitall((int)oldest.requests.size(), oldest.requests.data(), MPI_STATUSES_IGNORE);
+				Recycle(oldest);
+				queue.pop_front();
+			}
+		}
+
+		void SendStop(MessageHeader &header) override
+		{
+			StreamRing *ring = channels != NULL ? channels->OutboundRing(header.target) : NULL;
+			if (ring != NULL)
+			{
+				PublishRingRecord(*ring, ring->Head(), header, 0);
+				return;
+			}
+			MPI_Send(&header, sizeof(header), MPI_BYTE, header.target, MPI_DSPAR_MESSAGE_BOUNDARY, comm);
+		}
+
+		//Releases the buffers of items whose sends already completed, without blocking
+		void ReapCompletedSends() override
+		{
+			ReapCompletedDemands();
+			for (auto &targetQueue : inFlightMessages)
+			{
+				std::deque<InFlightMessage> &queue = targetQueue.second;
+				while (!queue.empty())
+				{
+					InFlightMessage &oldest = queue.front();
+					int completed = 0;
+					MPI_Testall((int)oldest.requests.size(), oldest.requests.data(), &completed, MPI_STATUSES_IGNORE);
+					if (!completed)
+					{
+						break;
+					}
+					Recycle(oldest);
+					queue.pop_front();
+				}
+			}
+		}
+
+		void WaitForPendingSends() override
+		{
+			for (auto &targetQueue : inFlightMessages)
+			{
+				for (auto &message : targetQueue.second)
+				{
+					MPI_Waitall((int)message.requests.size(), message.requests.data(), MPI_STATUSES_IGNORE);
+				}
+				targetQueue.second.clear();
+			}
+			for (auto &demand : pendingDemands)
+			{
+				demand.Await();
+			}
+			pendingDemands.clear();
+			FreePersistentSends();
+		}
+
+		size_t PendingSendsCount() override
+		{
+			size_t count = 0;
+			for (auto &targetQueue : inFlightMessages)
+			{
+				count += targetQueue.second.size();
+			}
+			return count;
+		}
+
+		void SendDemand(const DemandSignal &demand) override
+		{
+			MPI_Send(&demand, sizeof(DemandSignal), MPI_BYTE, demand.target, MPI_DSPAR_DEMAND, comm);
+		}
+
+		AsyncMPIRequest<DemandSignal> SendDemandAsync(const DemandSignal &demand) override
+		{
+			AsyncMPIRequest<DemandSignal> request;
+			request.Data() = demand;
+			MPI_Isend(&request.Data(), sizeof(DemandSignal), MPI_BYTE, demand.target, MPI_DSPAR_DEMAND, comm, request.Request());
+			ReapCompletedDemands();
+			pendingDemands.push_back(request);
+			return request;
+		}
+
+		MessageHeader ReceiveHeader() override
+		{
+			if (channels != NULL && !channels->InboundRings().empty())
+			{
+				ReleaseRingRecord();
+				return ReceiveFromRingsOrMPI();
+			}
+			return ReceiveMPIMessage();
+		}
+
+		void ReceiveBytes(MessageHeader &header, void *buffer, size_t bytes) override
+		{
+			if (header.framing == FRAME_RING)
+			{
+				if (ringEnd - ringCursor < bytes)
+				{
+					SERDE_ERROR("Ring record too short. Got " << (ringEnd - ringCursor) << " bytes left, expected to receive " << bytes << ". Aborting to prevent errors");
+					MPI_Abort(comm, 1);
+				}
+				currentRing->CopyOut(ringCursor, buffer, bytes);
+				ringCursor += bytes;
+				return;
+			}
+
+			if (header.framing != FRAME_SEPARATE)
+			{
+				if ((size_t)(packedEnd - packedCursor) < bytes)
+				{
+					SERDE_ERROR("Packed message too short. Got " << (packedEnd - packedCursor) << " bytes left, expected to receive " << bytes << ". Aborting to prevent errors");
+					MPI_Abort(comm, 1);
+				}
+				memcpy(buffer, packedCursor, bytes);
+				packedCursor += bytes;
+				return;
+			}
+
+			ProbeSize(header, bytes);
+			if (bytes == persistentReceiveBytes && bytes > 0 && header.partTag == MPI_DSPAR_STREAM_MESSAGE)
+			{
+				ReceivePersistent(header.sender, buffer, bytes);
+				return;
+			}
+			ReceivePart(header.sender, header.partTag, buffer, bytes);
+		}
+
+		//Counterpart of SendBlocks
+		void ReceiveBlocks(MessageHeader &header, const BlockList &list) override
+		{
+			if (list.blocks.empty())
+			{
+				return;
+			}
+			if (header.framing != FRAME_SEPARATE)
+			{
+				Transport::ReceiveBlocks(header, list);
+				return;
+			}
+
+			ProbeSize(header, list.totalBytes);
+			if (list.totalBytes <= globals::chunkBytes)
+			{
+				MPI_Status status;
+				BlockDatatype type = receiveTypes.Get(list.lengths, list.Displacements());
+				MPI_Recv(list.blocks[0], 1, type, header.sender, header.partTag, comm, &status);
+				CheckReceivedSize(status, list.totalBytes);
+				return;
+			}
+			std::vector<MPI_Request> requests;
+			for (const BlockList &chunk : list.Split(globals::chunkBytes))
+			{
+				PostBlockReceives(header.sender, header.partTag, chunk, requests);
+			}
+			WaitForChunks(requests, list.totalBytes);
+		}
+
+		//Counterpart of SendSized. With separate framing one matched probe tells a combined size and data
+		//message from a size-only one.
+		void ReceiveSized(MessageHeader &header, size_t elementSize, const std::function<void *(size_t)> &allocate) override
+		{
+			if (header.framing != FRAME_SEPARATE)
+			{
+				Transport::ReceiveSized(header, elementSize, allocate);
+				return;
+			}
+
+			size_t count;
+			MPI_Message message;
+			MPI_Status status;
+			MPI_Mprobe(header.sender, header.partTag, comm, &message, &status);
+			int bytes;
+			MPI_Get_count(&status, MPI_BYTE, &bytes);
+			if (bytes == (int)sizeof(size_t))
+			{
+				MPI_Mrecv(&count, sizeof(size_t), MPI_BYTE, &message, MPI_STATUS_IGNORE);
+				if (count > 0)
+				{
+					ReceiveBytes(header, allocate(count), count * elementSize);
+				}
+				return;
+			}
+
+			segmentMessage.resize(bytes);
+			MPI_Mrecv(segmentMessage.data(), bytes, MPI_BYTE, &message, MPI_STATUS_IGNORE);
+			memcpy(&count, segmentMessage.data(), sizeof(size_t));
+			if (sizeof(size_t) + count * elementSize != (size_t)bytes)
+			{
+				SERDE_ERROR("Sized message of wrong size. Got " << bytes << " bytes for " << count << " elements of " << elementSize << " bytes. Aborting to prevent errors");
+				MPI_Abort(comm, 1);
+			}
+			memcpy(allocate(count), segmentMessage.data() + sizeof(size_t), count * elementSize);
+		}
+
+		//Counterpart of SendSegments, the segments follow with ReceiveSegments
+		void ReceiveSegmentPrefix(MessageHeader &header, void *prefix, size_t prefixBytes) override
+		{
+			segmentsInPrefixMessage = false;
+			if (header.framing != FRAME_SEPARATE)
+			{
+				ReceiveBytes(header, prefix, prefixBytes);
+				return;
+			}
+
+			MPI_Message message;
+			MPI_Status status;
+			MPI_Mprobe(header.sender, header.partTag, comm, &message, &status);
+			int count;
+			MPI_Get_count(&status, MPI_BYTE, &count);
+			if (count == (int)prefixBytes)
+			{
+				MPI_Mrecv(prefix, count, MPI_BYTE, &message, MPI_STATUS_IGNORE);
+				return;
+			}
+			if (count < (int)prefixBytes)
+			{
+				SERDE_ERROR("Segment prefix too short. Got " << count << " bytes, expected at least " << prefixBytes << ". Aborting to prevent errors");
+				MPI_Abort(comm, 1);
+			}
+
+			//the sender copied the segments behind the prefix
+			segmentMessage.resize(count);
+			MPI_Mrecv(segmentMessage.data(), count, MPI_BYTE, &message, MPI_STATUS_IGNORE);
+			memcpy(prefix, segmentMessage.data(), prefixBytes);
+			packedCursor = segmentMessage.data() + prefixBytes;
+			packedEnd = segmentMessage.data() + count;
+			segmentsInPrefixMessage = true;
+		}
+
+		//Receives the segments of the item whose prefix was just read, directly into the given blocks
+		void ReceiveSegments(MessageHeader &header, const BlockList &segments) override
+		{
+			if (!segmentsInPrefixMessage)
+			{
+				ReceiveBlocks(header, segments);
+				return;
+			}
+			segmentsInPrefixMessage = false;
+			if ((size_t)(packedEnd - packedCursor) != segments.totalBytes)
+			{
+				SERDE_ERROR("Segments of wrong size. Got " << (packedEnd - packedCursor) << " bytes, expected to receive " << segments.totalBytes << ". Aborting to prevent errors");
+				MPI_Abort(comm, 1);
+			}
+			for (size_t i = 0; i < segments.blocks.size(); i++)
+			{
+				memcpy(segments.blocks[i], packedCursor, segments.lengths[i]);
+				packedCursor += segments.lengths[i];
+			}
+		}
+
+		AsyncMPIRequest<MessageHeader> ReceiveHeaderAsync() override
+		{
+			AsyncMPIRequest<MessageHeader> request;
+			MPI_Irecv(&request.Data(), sizeof(MessageHeader), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_MESSAGE_BOUNDARY, comm, request.Request());
+			return request;
+		}
+
+		bool HasMessageWaiting() override
+		{
+			if (channels != NULL && !channels->InboundRings().empty())
+			{
+				for (StreamRing *ring : channels->InboundRings())
+				{
+					if (RingHasRecord(*ring))
+					{
+						return true;
+					}
+				}
+				if (!channels->HasRemoteSources())
+				{
+					return false;
+				}
+			}
+			return HasMPIMessageWaiting();
+		}
+
+		DemandSignal ReceiveDemand() override
+		{
+			DemandSignal demand;
+			MPI_Status status;
+			MPI_Recv(&demand, sizeof(DemandSignal), MPI_BYTE, MPI_ANY_SOURCE, MPI_DSPAR_DEMAND, comm, &status);
+			demand.sender = status.MPI_SOURCE;
+			return demand;
+		}
+
+		bool TryReceivingDemand(DemandSignal &demand) override
+		{
+			int flag = 0;
+			MPI_Message message;
+			MPI_Status status;
+			MPI_Improbe(MPI_ANY_SOURCE, MPI_DSPAR_DEMAND, comm, &flag, &message, &status);
+			if (!flag)
+			{
+				return false;
+			}
+			MPI_Mrecv(&demand, sizeof(DemandSignal), MPI_BYTE, &message, &status);
+			demand.sender = status.MPI_SOURCE;
+			return true;
+		}
+
+		//Cancels the receives still posted
+		void StopReceiving() override
+		{
+			ReleaseRingRecord();
+			FreePersistentReceives();
+			if (!prefetchStarted)
+			{
+				return;
+			}
+			for (size_t i = 0; i < prefetchSlots.size(); i++)
+			{
+				PrefetchSlot &slot = prefetchSlots[i];
+				if ((int)i == consumedSlot)
+				{
+					continue;
+				}
+				if (!slot.arrived)
+				{
+					MPI_Cancel(&slot.request);
+					MPI_Wait(&slot.request, &slot.status);
+					int cancelled = 0;
+					MPI_Test_cancelled(&slot.status, &cancelled);
+					if (!cancelled)
+					{
+						LOG_ERROR("A message arrived after the node stopped receiving and was discarded");
+					}
+				}
+				if (slot.tailPosted)
+				{
+					MPI_Waitall((int)slot.tailRequests.size(), slot.tailRequests.data(), MPI_STATUSES_IGNORE);
+				}
+			}
+			prefetchStarted = false;
+			consumedSlot = -1;
+			nextSlot = 0;
+		}
+	};
+} // namespace dspar
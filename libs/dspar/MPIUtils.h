@@ -15,6 +15,7 @@
 #endif
 
 #include <iostream>
+#include <algorithm>
 #define COMMAND_SPAWN_NEW 1
 #define COMMAND_SPAWN_ENDED 2
 
@@ -34,9 +35,31 @@ namespace dspar
 			return intercomm;
 		}
 
+		void InitMPI(int *argc, char ***argv)
+		{
+			if (!dspar::globals::requestThreadMultiple)
+			{
+				MPI_Init(argc, argv);
+				return;
+			}
+			int provided;
+			MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &provided);
+			dspar::globals::threadMultiple = provided == MPI_THREAD_MULTIPLE;
+			if (!dspar::globals::threadMultiple)
+			{
+				std::cerr << "MPI_THREAD_MULTIPLE is not supported by this MPI library, receive on one thread per rank" << std::endl;
+			}
+		}
+
 	public:
 		MPIUtils() : numberOfProcessesAlreadySet(false){};
 
+		//Initializes MPI with MPI_THREAD_MULTIPLE, so several threads of a rank may receive and send
+		//stream messages, each with its own MPIReceiver. Every process must call it before MPI is initialized.
+		void SetThreadMultiple(bool enabled) {
+			dspar::globals::requestThreadMultiple = enabled;
+		}
+
 		MPI_Comm SetTotalNumberOfProcesses(int argc, char **argv, int numberOfProcesses)
 		{
 			if (numberOfProcessesAlreadySet)
@@ -44,7 +67,7 @@ namespace dspar
 				std::cerr << "Cannot set number of processes twice for now, only once" << std::endl;
 			}
 
-			MPI_Init(&argc, &argv);
+			InitMPI(&argc, &argv);
 
 			MPI_Comm parent;
 			MPI_Comm_get_parent(&parent);
@@ -121,6 +144,10 @@ namespace dspar
 
 		int GetMyRank(MPI_Comm &comm)
 		{
+			if (CurrentTransport() != NULL)
+			{
+				return CurrentTransport()->GetMyRank();
+			}
 			int rank = -1;
 			MPI_Comm_rank(comm, &rank);
 			return rank;
@@ -128,6 +155,10 @@ namespace dspar
 
 		int GetCommSize(MPI_Comm &comm)
 		{
+			if (CurrentTransport() != NULL)
+			{
+				return CurrentTransport()->GetSize();
+			}
 			int size = -1;
 			MPI_Comm_size(comm, &size);
 			return size;
@@ -138,12 +169,12 @@ namespace dspar
 		}
 
 		void Init() {
-			MPI_Init(&dspar::globals::argc, &dspar::globals::argv);
+			InitMPI(&dspar::globals::argc, &dspar::globals::argv);
 		}
 
 		
 		void Init(int* argc, char*** argv) {
-			MPI_Init(argc, argv);
+			InitMPI(argc, argv);
 		}
 
 		void ScheduleFinalizeAtProgramExit() {
@@ -155,7 +186,38 @@ namespace dspar
 			}
 		}
 
+		//Stream edges between ranks of the same host use shared memory rings of bytesPerEdge bytes.
+		//Every process must call it with the same value before starting the graph, 0 disables it.
+		void SetSharedMemoryRingSize(uint64_t bytesPerEdge) {
+			dspar::globals::sharedMemoryRingBytes = bytesPerEdge;
+		}
+
+		//Every stream edge goes through a ring of bytesPerEdge bytes in an RMA window of the receiver:
+		//senders MPI_Put records and a counter, receivers poll the counter instead of matching messages.
+		//Every process must call it with the same value before starting the graph. Takes precedence over
+		//SetSharedMemoryRingSize, 0 disables it.
+		void SetRMARingSize(uint64_t bytesPerEdge) {
+			dspar::globals::rmaRingBytes = bytesPerEdge;
+		}
+
+		//Payload parts larger than bytes are sent as consecutive chunks of this size with overlapping MPI_Isend,
+		//and received the same way straight into their destination. Every process must call it with the same
+		//value before starting the graph. 0 only splits parts larger than DSPAR_MAX_CHUNK_BYTES. Chunks are at
+		//least DSPAR_INLINE_PAYLOAD_CAPACITY, so small messages that are probed (sizes, combined parts) stay whole.
+		void SetChunkSize(uint64_t bytes) {
+			if (bytes == 0 || bytes > DSPAR_MAX_CHUNK_BYTES)
+			{
+				bytes = DSPAR_MAX_CHUNK_BYTES;
+			}
+			dspar::globals::chunkBytes = std::max(bytes, (uint64_t)DSPAR_INLINE_PAYLOAD_CAPACITY);
+		}
+
 		void Barrier(MPI_Comm comm) {
+			if (CurrentTransport() != NULL)
+			{
+				CurrentTransport()->Barrier();
+				return;
+			}
 			MPI_Barrier(comm);
 		}
 	};
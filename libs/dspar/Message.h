@@ -17,12 +17,20 @@ namespace dspar
 		int sender;
 		int target;
 		int type;
+		//MPI tag of the payload parts that follow the header (see MPITransport::NextPartTag)
+		int partTag;
 #ifdef DSPARTIMINGS
 		//accumulates all .Process() times for this msg id
 		Duration::rep totalComputeTime;
 		Duration::rep ts;
 #endif
 		uint64_t id;
+		//FRAME_* flags describing how the item payload travels after this header
+		uint32_t framing;
+		//number of stream items serialized in this message, more than 1 for batches
+		uint32_t itemCount;
+		//bytes of packed payload carried inline or in the tail message
+		uint64_t payloadBytes;
 	};
 
 } // namespace dspar
\ No newline at end of file
@@ -80,7 +80,7 @@ namespace dspar
                 }
                 delete p;
             }
-            MPI_Barrier(comm);
+            utils.Barrier(comm);
         }
 
         std::vector<Plan *> GetPlans()
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <map>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include "StreamChannels.h"
+
+namespace dspar
+{
+	//One edge exposed by the receiving rank through an MPI RMA window. The sender stages a whole record
+	//locally and writes it with MPI_Put, then advances the head counter with an atomic MPI_Accumulate.
+	//The receiver reads the payload from its own window memory and polls the counter, so stream
+	//messages never go through MPI tag matching.
+	class RMARing : public StreamRing
+	{
+	public:
+		//offsets inside a ring, the counters are on separate cache lines
+		static const MPI_Aint HEAD_OFFSET = 0;
+		static const MPI_Aint TAIL_OFFSET = 64;
+		static const MPI_Aint DATA_OFFSET = 128;
+
+		MPI_Win window;
+		//rank exposing the ring and where it starts in its window
+		int owner;
+		MPI_Aint base;
+		//window memory of the ring on the receiving side, NULL on the sending side
+		char *local;
+
+		//sender side: record being written and the counters as last seen
+		std::vector<char> staging;
+		uint64_t stagingStart;
+		uint64_t head;
+		uint64_t tail;
+
+		RMARing() : owner(-1), base(0), local(NULL), stagingStart(0), head(0), tail(0) {}
+
+		void CopyIn(uint64_t position, const void *source, size_t bytes) override
+		{
+			if (staging.empty())
+			{
+				stagingStart = position;
+			}
+			else if (position < stagingStart)
+			{
+				//the record prefix is written after its payload
+				staging.insert(staging.begin(), stagingStart - position, 0);
+				stagingStart = position;
+			}
+			uint64_t offset = position - stagingStart;
+			if (staging.size() < offset + bytes)
+			{
+				staging.resize(offset + bytes);
+			}
+			memcpy(staging.data() + offset, source, bytes);
+		}
+
+		void CopyOut(uint64_t position, void *target, size_t bytes) override
+		{
+			if (local == NULL)
+			{
+				memcpy(target, staging.data() + (position - stagingStart), bytes);
+				return;
+			}
+			uint64_t offset = position % capacity;
+			size_t first = std::min((uint64_t)bytes, capacity - offset);
+			memcpy(target, local + DATA_OFFSET + offset, first);
+			memcpy((char *)target + first, local + DATA_OFFSET, bytes - first);
+		}
+
+		void WaitForSpace(uint64_t position) override
+		{
+			while (position - tail > capacity)
+			{
+				tail = ReadCounter(TAIL_OFFSET);
+				if (position - tail > capacity)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		uint64_t Head() override
+		{
+			if (local == NULL)
+			{
+				return head;
+			}
+			head = ReadCounter(HEAD_OFFSET);
+			//payload written before the counter is visible in the window memory from here
+			MPI_Win_sync(window);
+			return head;
+		}
+
+		void Publish(uint64_t _head) override
+		{
+			uint64_t offset = stagingStart % capacity;
+			uint64_t bytes = _head - stagingStart;
+			staging.resize(bytes);
+			uint64_t first = std::min(bytes, capacity - offset);
+			MPI_Put(staging.data(), (int)first, MPI_BYTE, owner, base + DATA_OFFSET + offset, (int)first, MPI_BYTE, window);
+			if (bytes > first)
+			{
+				MPI_Put(staging.data() + first, (int)(bytes - first), MPI_BYTE, owner, base + DATA_OFFSET, (int)(bytes - first), MPI_BYTE, window);
+			}
+			//the record must be complete at the target before the counter moves
+			MPI_Win_flush(owner, window);
+			head = _head;
+			WriteCounter(HEAD_OFFSET, head);
+			staging.clear();
+		}
+
+		uint64_t Tail() override
+		{
+			return tail;
+		}
+
+		void Release(uint64_t _tail) override
+		{
+			tail = _tail;
+			WriteCounter(TAIL_OFFSET, tail);
+		}
+
+	private:
+		uint64_t ReadCounter(MPI_Aint offset)
+		{
+			uint64_t value;
+			MPI_Fetch_and_op(NULL, &value, MPI_UINT64_T, owner, base + offset, MPI_NO_OP, window);
+			MPI_Win_flush(owner, window);
+			return value;
+		}
+
+		void WriteCounter(MPI_Aint offset, uint64_t value)
+		{
+			MPI_Accumulate(&value, 1, MPI_UINT64_T, owner, base + offset, 1, MPI_UINT64_T, MPI_REPLACE, window);
+			MPI_Win_flush(owner, window);
+		}
+	};
+
+	//Rings for every edge of the stream graph, one RMA window per graph. Every rank exposes one ring per source.
+	class RMAChannels : public StreamChannels
+	{
+	private:
+		MPI_Win window;
+		std::map<int, RMARing> outboundRings;
+		std::vector<RMARing> inboundRings;
+		std::vector<StreamRing *> inboundRingPointers;
+
+		static uint64_t RingStride(uint64_t capacity)
+		{
+			return RMARing::DATA_OFFSET + capacity;
+		}
+
+		RMARing RingAt(int owner, size_t index, uint64_t capacity, int peer)
+		{
+			RMARing ring;
+			ring.window = window;
+			ring.owner = owner;
+			ring.base = (MPI_Aint)(index * RingStride(capacity));
+			ring.capacity = capacity;
+			ring.peer = peer;
+			return ring;
+		}
+
+	public:
+		RMAChannels(MPI_Comm comm, std::vector<int> sourceRanks, uint64_t ringBytes)
+		{
+			ringBytes = std::max(ringBytes, 4 * RING_RECORD_PREFIX);
+			ringBytes = (ringBytes + 7) & ~(uint64_t)7;
+
+			int myRank, size;
+			MPI_Comm_rank(comm, &myRank);
+			MPI_Comm_size(comm, &size);
+
+			std::vector<int> counts, displacements, allSources;
+			GatherSourceLists(comm, sourceRanks, counts, displacements, allSources);
+
+			char *segment = NULL;
+			uint64_t segmentBytes = sourceRanks.size() * RingStride(ringBytes);
+			MPI_Win_allocate((MPI_Aint)segmentBytes, 1, MPI_INFO_NULL, comm, &segment, &window);
+			MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+			memset(segment, 0, segmentBytes);
+			MPI_Win_sync(window);
+
+			for (size_t i = 0; i < sourceRanks.size(); i++)
+			{
+				RMARing ring = RingAt(myRank, i, ringBytes, sourceRanks[i]);
+				ring.local = segment + ring.base;
+				inboundRings.push_back(ring);
+			}
+			for (auto &ring : inboundRings)
+			{
+				inboundRingPointers.push_back(&ring);
+			}
+
+			for (int rank = 0; rank < size; rank++)
+			{
+				for (int i = 0; i < counts[rank]; i++)
+				{
+					if (allSources[displacements[rank] + i] == myRank)
+					{
+						outboundRings[rank] = RingAt(rank, i, ringBytes, rank);
+					}
+				}
+			}
+
+			//counters are zeroed before anyone writes to them
+			MPI_Barrier(comm);
+		}
+
+		void Free() override
+		{
+			MPI_Win_unlock_all(window);
+			MPI_Win_free(&window);
+		}
+
+		StreamRing *OutboundRing(int target) override
+		{
+			auto it = outboundRings.find(target);
+			return it == outboundRings.end() ? NULL : &it->second;
+		}
+
+		std::vector<StreamRing *> &InboundRings() override
+		{
+			return inboundRingPointers;
+		}
+
+		//Every edge of the graph has a ring
+		bool HasRemoteSources() override
+		{
+			return false;
+		}
+	};
+} // namespace dspar
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+namespace dspar
+{
+	//Values that arrived ahead of their turn, in a ring indexed by their sequence id. Ids buffered are always less than
+	//the ring size ahead of the next id to release, so each has its own slot; the ring doubles when one is further ahead.
+	//Values are moved in and out, releasing the next one costs O(1).
+	template <typename T>
+	class ReorderBuffer
+	{
+	private:
+		//values of each id, more than one only if a sender reuses ids
+		std::vector<std::vector<T>> slots;
+		size_t count = 0;
+
+		std::vector<T> &SlotOf(uint64_t id)
+		{
+			return slots[id & (slots.size() - 1)];
+		}
+
+		void Grow(uint64_t next)
+		{
+			std::vector<std::vector<T>> grown(slots.size() * 2);
+			for (uint64_t id = next; id < next + slots.size(); id++)
+			{
+				grown[id & (grown.size() - 1)].swap(SlotOf(id));
+			}
+			slots.swap(grown);
+		}
+
+	public:
+		//capacity is rounded up to a power of two
+		ReorderBuffer(size_t capacity = 16)
+		{
+			size_t size = 1;
+			while (size < capacity)
+			{
+				size *= 2;
+			}
+			slots.resize(size);
+		}
+
+		//Buffers value of id, which is after next, the id to release next
+		void Insert(uint64_t id, uint64_t next, T value)
+		{
+			while (id - next >= slots.size())
+			{
+				Grow(next);
+			}
+			SlotOf(id).push_back(std::move(value));
+			count++;
+		}
+
+		//Moves the values of id into released (emptied first), false when none arrived yet
+		bool Take(uint64_t id, std::vector<T> &released)
+		{
+			released.clear();
+			if (count == 0 || SlotOf(id).empty())
+			{
+				return false;
+			}
+			released.swap(SlotOf(id));
+			count -= released.size();
+			return true;
+		}
+
+		size_t Size()
+		{
+			return count;
+		}
+
+		size_t Capacity()
+		{
+			return slots.size();
+		}
+	};
+} // namespace dspar
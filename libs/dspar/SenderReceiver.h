@@ -4,6 +4,13 @@
 
 namespace dspar
 {
+	//Bytes an item of type T takes on the wire when known at compile time, 0 otherwise. Trivial types
+	//(std::array of them included) are sent as their bytes. Specialize it for types whose serializer
+	//always sends them as one SendTo of the same size.
+	template <typename T>
+	struct WireSize : std::integral_constant<size_t, std::is_trivial<T>::value && !std::is_pointer<T>::value ? sizeof(T) : 0>
+	{
+	};
 
 	template <typename T>
 	class SenderReceiver
@@ -24,6 +31,14 @@ namespace dspar
 		}
 
 		virtual void OnStart(){};
+
+		//Bytes of every item on the wire when they are sent as one part of a size that never changes, 0 otherwise
+		//(usually WireSize<T>::value). Nodes then send and receive that part through persistent requests,
+		//and receive it ahead of time when prefetching payloads.
+		virtual size_t FixedWireSize()
+		{
+			return 0;
+		}
 	};
 
 	template <typename T>
@@ -40,6 +55,45 @@ namespace dspar
 			receiver.Receive(msg, &data);
 			return data;
 		};
+
+		size_t FixedWireSize() override
+		{
+			return WireSize<T>::value;
+		}
+	};
+
+	//Serializer that describes an item as a small trivial Prefix (sizes, flags, scalars) plus a list of memory
+	//segments instead of calling SendTo. The prefix and all segments travel together: small items as one
+	//contiguous copy, larger ones without intermediate copies through a derived datatype.
+	template <typename T, typename Prefix>
+	class SegmentSenderReceiver : public SenderReceiver<T>
+	{
+		static_assert(std::is_trivial<Prefix>::value, "The prefix of a segmented item must be a trivial type");
+
+	public:
+		//Fills the prefix and adds the segments of data, in order
+		virtual void Describe(T &data, Prefix &prefix, BlockList &segments) = 0;
+		//Creates an item from the prefix and adds the segments to receive its data into.
+		//Their lengths must add up to those given by Describe, the split may differ.
+		virtual T Allocate(Prefix &prefix, BlockList &segments) = 0;
+
+		void Send(MPISender &sender, MessageHeader &msg, T &data) override
+		{
+			Prefix prefix;
+			BlockList segments;
+			Describe(data, prefix, segments);
+			sender.SendSegments(msg, &prefix, sizeof(Prefix), segments);
+		};
+
+		T Receive(MPIReceiver &receiver, MessageHeader &msg) override
+		{
+			Prefix prefix;
+			receiver.ReceiveSegmentPrefix(msg, &prefix, sizeof(Prefix));
+			BlockList segments;
+			T data = Allocate(prefix, segments);
+			receiver.ReceiveSegments(msg, segments);
+			return data;
+		};
 	};
 
 	template <typename T>
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <map>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "StreamChannels.h"
+
+namespace dspar
+{
+	//Positions of a shared memory ring, on separate cache lines
+	struct SharedRingControl
+	{
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+	};
+
+	//One edge between two ranks of the same host, living in an MPI_Win_allocate_shared window
+	class SharedRing : public StreamRing
+	{
+	public:
+		SharedRingControl *control;
+		char *data;
+
+		void CopyIn(uint64_t position, const void *source, size_t bytes) override
+		{
+			uint64_t offset = position % capacity;
+			size_t first = std::min((uint64_t)bytes, capacity - offset);
+			memcpy(data + offset, source, first);
+			memcpy(data, (const char *)source + first, bytes - first);
+		}
+
+		void CopyOut(uint64_t position, void *target, size_t bytes) override
+		{
+			uint64_t offset = position % capacity;
+			size_t first = std::min((uint64_t)bytes, capacity - offset);
+			memcpy(target, data + offset, first);
+			memcpy((char *)target + first, data, bytes - first);
+		}
+
+		void WaitForSpace(uint64_t position) override
+		{
+			while (position - control->tail.load(std::memory_order_acquire) > capacity)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		uint64_t Head() override
+		{
+			return control->head.load(std::memory_order_acquire);
+		}
+
+		void Publish(uint64_t head) override
+		{
+			control->head.store(head, std::memory_order_release);
+		}
+
+		uint64_t Tail() override
+		{
+			return control->tail.load(std::memory_order_acquire);
+		}
+
+		void Release(uint64_t tail) override
+		{
+			control->tail.store(tail, std::memory_order_release);
+		}
+	};
+
+	//Rings for every edge of the stream graph whose ends run on the same host
+	class SharedMemoryChannels : public StreamChannels
+	{
+	private:
+		MPI_Comm nodeComm;
+		MPI_Win window;
+		std::map<int, SharedRing> outboundRings;
+		std::vector<SharedRing> inboundRings;
+		std::vector<StreamRing *> inboundRingPointers;
+		bool hasRemoteSources;
+
+		static uint64_t RingStride(uint64_t capacity)
+		{
+			return sizeof(SharedRingControl) + capacity;
+		}
+
+		static SharedRing RingAt(char *segment, size_t index, uint64_t capacity, int peer)
+		{
+			SharedRing ring;
+			ring.control = (SharedRingControl *)(segment + index * RingStride(capacity));
+			ring.data = (char *)ring.control + sizeof(SharedRingControl);
+			ring.capacity = capacity;
+			ring.peer = peer;
+			return ring;
+		}
+
+	public:
+		SharedMemoryChannels(MPI_Comm comm, std::vector<int> sourceRanks, uint64_t ringBytes) : hasRemoteSources(false)
+		{
+			//room for a few header-only records, larger items fall back to MPI anyway
+			ringBytes = std::max(ringBytes, 4 * RING_RECORD_PREFIX);
+			ringBytes = (ringBytes + 7) & ~(uint64_t)7;
+
+			int myRank, nodeSize;
+			MPI_Comm_rank(comm, &myRank);
+			MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm);
+			MPI_Comm_size(nodeComm, &nodeSize);
+
+			//comm rank of every rank on this host, indexed by node rank
+			std::vector<int> nodeMembers(nodeSize);
+			MPI_Allgather(&myRank, 1, MPI_INT, nodeMembers.data(), 1, MPI_INT, nodeComm);
+
+			std::vector<int> localSources;
+			for (int source : sourceRanks)
+			{
+				if (std::find(nodeMembers.begin(), nodeMembers.end(), source) != nodeMembers.end())
+				{
+					localSources.push_back(source);
+				}
+				else
+				{
+					hasRemoteSources = true;
+				}
+			}
+
+			//every rank learns the local sources of the others to find its rings in their segments
+			std::vector<int> counts, displacements, allSources;
+			GatherSourceLists(nodeComm, localSources, counts, displacements, allSources);
+
+			char *segment = NULL;
+			MPI_Info info;
+			MPI_Info_create(&info);
+			MPI_Info_set(info, "alloc_shared_noncontig", "true");
+			MPI_Win_allocate_shared((MPI_Aint)(localSources.size() * RingStride(ringBytes)), 1, info, nodeComm, &segment, &window);
+			MPI_Info_free(&info);
+
+			for (size_t i = 0; i < localSources.size(); i++)
+			{
+				SharedRing ring = RingAt(segment, i, ringBytes, localSources[i]);
+				new (ring.control) SharedRingControl();
+				ring.control->head.store(0);
+				ring.control->tail.store(0);
+				inboundRings.push_back(ring);
+			}
+			for (auto &ring : inboundRings)
+			{
+				inboundRingPointers.push_back(&ring);
+			}
+
+			for (int member = 0; member < nodeSize; member++)
+			{
+				for (int i = 0; i < counts[member]; i++)
+				{
+					if (allSources[displacements[member] + i] != myRank)
+					{
+						continue;
+					}
+					MPI_Aint size;
+					int unit;
+					char *targetSegment;
+					MPI_Win_shared_query(window, member, &size, &unit, &targetSegment);
+					outboundRings[nodeMembers[member]] = RingAt(targetSegment, i, ringBytes, nodeMembers[member]);
+				}
+			}
+
+			//rings are initialized before anyone writes to them
+			MPI_Barrier(nodeComm);
+		}
+
+		void Free() override
+		{
+			MPI_Win_free(&window);
+			MPI_Comm_free(&nodeComm);
+		}
+
+		StreamRing *OutboundRing(int target) override
+		{
+			auto it = outboundRings.find(target);
+			return it == outboundRings.end() ? NULL : &it->second;
+		}
+
+		std::vector<StreamRing *> &InboundRings() override
+		{
+			return inboundRingPointers;
+		}
+
+		//False when every source of this rank runs on the same host, so MPI never carries stream messages to it
+		bool HasRemoteSources() override
+		{
+			return hasRemoteSources;
+		}
+	};
+} // namespace dspar
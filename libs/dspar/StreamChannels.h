@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include "Message.h"
+#include "MPIUtils.h"
+
+namespace dspar
+{
+	//Single producer, single consumer byte ring of one stream edge. Positions only grow, offsets are taken modulo capacity.
+	//Records are [uint64_t record size][MessageHeader][payload], padded to 8 bytes.
+	class StreamRing
+	{
+	public:
+		uint64_t capacity;
+		int peer;
+
+		virtual ~StreamRing() {}
+
+		virtual void CopyIn(uint64_t position, const void *source, size_t bytes) = 0;
+		virtual void CopyOut(uint64_t position, void *target, size_t bytes) = 0;
+
+		//Blocks the sender until the ring has room up to position
+		virtual void WaitForSpace(uint64_t position) = 0;
+
+		//Bytes published by the sender, everything before it can be read
+		virtual uint64_t Head() = 0;
+		virtual void Publish(uint64_t head) = 0;
+
+		//Bytes released by the receiver, the sender may overwrite everything before it
+		virtual uint64_t Tail() = 0;
+		virtual void Release(uint64_t tail) = 0;
+	};
+
+	const uint64_t RING_RECORD_PREFIX = sizeof(uint64_t) + sizeof(MessageHeader);
+
+	//Rings of the stream edges a node sends and receives through instead of two-sided MPI.
+	//Built collectively by all ranks of the graph, each rank passing the ranks it receives from.
+	class StreamChannels
+	{
+	public:
+		virtual ~StreamChannels() {}
+
+		//NULL when items to target go through MPI
+		virtual StreamRing *OutboundRing(int target) = 0;
+		virtual std::vector<StreamRing *> &InboundRings() = 0;
+
+		//True when some source is not reachable through the rings, so MPI must be polled too
+		virtual bool HasRemoteSources() = 0;
+
+		//Collective, called once every node stopped using the rings
+		virtual void Free() = 0;
+
+	protected:
+		//Gathers the source list of every rank of comm: allSources[displacements[r] ... + counts[r]] are the sources of rank r
+		static void GatherSourceLists(MPI_Comm comm, std::vector<int> &sources, std::vector<int> &counts,
+									  std::vector<int> &displacements, std::vector<int> &allSources)
+		{
+			int size;
+			MPI_Comm_size(comm, &size);
+			int count = (int)sources.size();
+			counts.resize(size);
+			displacements.resize(size);
+			MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+			int total = 0;
+			for (int i = 0; i < size; i++)
+			{
+				displacements[i] = total;
+				total += counts[i];
+			}
+			allSources.resize(total > 0 ? total : 1);
+			MPI_Allgatherv(sources.data(), count, MPI_INT, allSources.data(), counts.data(), displacements.data(), MPI_INT, comm);
+		}
+	};
+} // namespace dspar
@@ -0,0 +1,426 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <optional>
+#endif
+#include "SenderReceiver.h"
+
+//Declares the fields of a struct so StructSendReceive<Type> can serialize it, in the namespace of the struct:
+//    DSPAR_SERIALIZABLE(Particle, id, position, tags)
+//Up to 32 fields, listed in the order they go on the wire.
+#define DSPAR_SERIALIZABLE(Type, ...)                                                           \
+	inline auto DsparFields(Type &value) -> decltype(std::tie(DSPAR_PP_FIELDS(__VA_ARGS__))) \
+	{                                                                                       \
+		return std::tie(DSPAR_PP_FIELDS(__VA_ARGS__));                                      \
+	}
+
+//value.field for every field given, the extra expansions are needed by the MSVC preprocessor
+#define DSPAR_PP_EXPAND(x) x
+#define DSPAR_PP_CONCAT(a, b) DSPAR_PP_CONCAT_(a, b)
+#define DSPAR_PP_CONCAT_(a, b) a##b
+#define DSPAR_PP_COUNT(...) DSPAR_PP_EXPAND(DSPAR_PP_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define DSPAR_PP_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define DSPAR_PP_FIELDS(...) DSPAR_PP_EXPAND(DSPAR_PP_CONCAT(DSPAR_PP_FIELDS_, DSPAR_PP_COUNT(__VA_ARGS__))(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_1(f) value.f
+#define DSPAR_PP_FIELDS_2(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_1(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_3(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_2(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_4(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_3(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_5(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_4(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_6(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_5(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_7(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_6(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_8(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_7(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_9(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_8(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_10(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_9(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_11(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_10(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_12(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_11(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_13(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_12(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_14(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_13(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_15(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_14(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_16(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_15(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_17(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_16(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_18(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_17(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_19(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_18(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_20(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_19(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_21(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_20(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_22(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_21(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_23(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_22(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_24(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_23(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_25(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_24(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_26(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_25(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_27(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_26(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_28(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_27(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_29(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_28(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_30(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_29(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_31(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_30(__VA_ARGS__))
+#define DSPAR_PP_FIELDS_32(f, ...) value.f, DSPAR_PP_EXPAND(DSPAR_PP_FIELDS_31(__VA_ARGS__))
+
+namespace dspar
+{
+	//Never matches, only makes DsparFields a known name for the lookup of declared field lists
+	struct NoFieldList;
+	void DsparFields(NoFieldList &);
+
+	//True when DSPAR_SERIALIZABLE declared the fields of T
+	template <typename T>
+	struct HasFieldList
+	{
+	private:
+		template <typename U>
+		static auto Check(int) -> decltype(DsparFields(std::declval<U &>()), std::true_type());
+		template <typename U>
+		static std::false_type Check(...);
+
+	public:
+		static const bool value = decltype(Check<T>(0))::value;
+	};
+
+	//Read position in a packed item, stops at the end instead of reading past it
+	struct FieldReader
+	{
+		const char *cursor;
+		const char *end;
+		bool failed = false;
+
+		FieldReader(const char *data, size_t bytes) : cursor(data), end(data + bytes) {}
+
+		bool Take(void *target, size_t bytes)
+		{
+			if (failed || (size_t)(end - cursor) < bytes)
+			{
+				failed = true;
+				return false;
+			}
+			memcpy(target, cursor, bytes);
+			cursor += bytes;
+			return true;
+		}
+
+		//Reads a length, failing when fewer than count elements of elementBytes could follow it
+		bool TakeLength(uint64_t &count, size_t elementBytes)
+		{
+			if (!Take(&count, sizeof(uint64_t)) || count > (uint64_t)(end - cursor) / std::max(elementBytes, (size_t)1))
+			{
+				failed = true;
+				return false;
+			}
+			return true;
+		}
+	};
+
+	//How a field is sized, packed and unpacked. Each type provides
+	//    static size_t Size(T &value);
+	//    static void Write(char *&out, T &value);
+	//    static void Read(FieldReader &in, T &value);
+	//Types without a specialization do not compile with StructSendReceive.
+	template <typename T, typename Enable = void>
+	struct FieldCodec;
+
+	//Trivial types (scalars, enums, plain structs and arrays of them) go as their bytes. Structs with a
+	//field list are packed field by field instead, so those holding pointers must declare one.
+	template <typename T>
+	struct FieldCodec<T, typename std::enable_if<std::is_trivial<T>::value && !std::is_pointer<T>::value && !HasFieldList<T>::value>::type>
+	{
+		static size_t Size(T &)
+		{
+			return sizeof(T);
+		}
+
+		static void Write(char *&out, T &value)
+		{
+			memcpy(out, &value, sizeof(T));
+			out += sizeof(T);
+		}
+
+		static void Read(FieldReader &in, T &value)
+		{
+			in.Take(&value, sizeof(T));
+		}
+	};
+
+	//Fields of a tuple of references (a field list) or of values, from index I on
+	template <typename Tuple, size_t I = 0, size_t N = std::tuple_size<Tuple>::value>
+	struct TupleCodec
+	{
+		typedef typename std::remove_reference<typename std::tuple_element<I, Tuple>::type>::type Field;
+		typedef TupleCodec<Tuple, I + 1, N> Rest;
+
+		static size_t Size(Tuple &tuple)
+		{
+			return FieldCodec<Field>::Size(std::get<I>(tuple)) + Rest::Size(tuple);
+		}
+
+		static void Write(char *&out, Tuple &tuple)
+		{
+			FieldCodec<Field>::Write(out, std::get<I>(tuple));
+			Rest::Write(out, tuple);
+		}
+
+		static void Read(FieldReader &in, Tuple &tuple)
+		{
+			FieldCodec<Field>::Read(in, std::get<I>(tuple));
+			Rest::Read(in, tuple);
+		}
+	};
+
+	template <typename Tuple, size_t N>
+	struct TupleCodec<Tuple, N, N>
+	{
+		static size_t Size(Tuple &)
+		{
+			return 0;
+		}
+
+		static void Write(char *&, Tuple &) {}
+
+		static void Read(FieldReader &, Tuple &) {}
+	};
+
+	template <typename T>
+	struct FieldCodec<T, typename std::enable_if<HasFieldList<T>::value>::type>
+	{
+		typedef decltype(DsparFields(std::declval<T &>())) Fields;
+
+		static size_t Size(T &value)
+		{
+			Fields fields = DsparFields(value);
+			return TupleCodec<Fields>::Size(fields);
+		}
+
+		static void Write(char *&out, T &value)
+		{
+			Fields fields = DsparFields(value);
+			TupleCodec<Fields>::Write(out, fields);
+		}
+
+		static void Read(FieldReader &in, T &value)
+		{
+			Fields fields = DsparFields(value);
+			TupleCodec<Fields>::Read(in, fields);
+		}
+	};
+
+	//Elements of a sequence with a 64-bit length, copied at once when trivial and without a field list
+	template <typename T, bool Trivial = std::is_trivial<T>::value && !std::is_pointer<T>::value && !HasFieldList<T>::value>
+	struct SequenceCodec
+	{
+		template <typename Sequence>
+		static size_t Size(Sequence &sequence)
+		{
+			return sizeof(uint64_t) + sequence.size() * sizeof(T);
+		}
+
+		template <typename Sequence>
+		static void Write(char *&out, Sequence &sequence)
+		{
+			uint64_t count = sequence.size();
+			memcpy(out, &count, sizeof(uint64_t));
+			out += sizeof(uint64_t);
+			if (count > 0)
+			{
+				memcpy(out, &sequence[0], count * sizeof(T));
+				out += count * sizeof(T);
+			}
+		}
+
+		template <typename Sequence>
+		static void Read(FieldReader &in, Sequence &sequence)
+		{
+			uint64_t count;
+			if (!in.TakeLength(count, sizeof(T)))
+			{
+				return;
+			}
+			sequence.resize(count);
+			if (count > 0)
+			{
+				in.Take(&sequence[0], count * sizeof(T));
+			}
+		}
+	};
+
+	template <typename T>
+	struct SequenceCodec<T, false>
+	{
+		template <typename Sequence>
+		static size_t Size(Sequence &sequence)
+		{
+			size_t bytes = sizeof(uint64_t);
+			for (auto &element : sequence)
+			{
+				bytes += FieldCodec<T>::Size(element);
+			}
+			return bytes;
+		}
+
+		template <typename Sequence>
+		static void Write(char *&out, Sequence &sequence)
+		{
+			uint64_t count = sequence.size();
+			memcpy(out, &count, sizeof(uint64_t));
+			out += sizeof(uint64_t);
+			for (auto &element : sequence)
+			{
+				FieldCodec<T>::Write(out, element);
+			}
+		}
+
+		template <typename Sequence>
+		static void Read(FieldReader &in, Sequence &sequence)
+		{
+			uint64_t count;
+			if (!in.TakeLength(count, 1))
+			{
+				return;
+			}
+			sequence.resize(count);
+			for (auto &element : sequence)
+			{
+				FieldCodec<T>::Read(in, element);
+			}
+		}
+	};
+
+	template <>
+	struct FieldCodec<std::string> : SequenceCodec<char>
+	{
+	};
+
+	template <typename T>
+	struct FieldCodec<std::vector<T>> : SequenceCodec<T>
+	{
+	};
+
+	//Arrays of trivial elements are trivial themselves and copied as a whole
+	template <typename T, size_t N>
+	struct FieldCodec<std::array<T, N>, typename std::enable_if<!std::is_trivial<T>::value>::type>
+	{
+		static size_t Size(std::array<T, N> &array)
+		{
+			size_t bytes = 0;
+			for (auto &element : array)
+			{
+				bytes += FieldCodec<T>::Size(element);
+			}
+			return bytes;
+		}
+
+		static void Write(char *&out, std::array<T, N> &array)
+		{
+			for (auto &element : array)
+			{
+				FieldCodec<T>::Write(out, element);
+			}
+		}
+
+		static void Read(FieldReader &in, std::array<T, N> &array)
+		{
+			for (auto &element : array)
+			{
+				FieldCodec<T>::Read(in, element);
+			}
+		}
+	};
+
+	template <typename First, typename Second>
+	struct FieldCodec<std::pair<First, Second>>
+	{
+		static size_t Size(std::pair<First, Second> &pair)
+		{
+			return FieldCodec<First>::Size(pair.first) + FieldCodec<Second>::Size(pair.second);
+		}
+
+		static void Write(char *&out, std::pair<First, Second> &pair)
+		{
+			FieldCodec<First>::Write(out, pair.first);
+			FieldCodec<Second>::Write(out, pair.second);
+		}
+
+		static void Read(FieldReader &in, std::pair<First, Second> &pair)
+		{
+			FieldCodec<First>::Read(in, pair.first);
+			FieldCodec<Second>::Read(in, pair.second);
+		}
+	};
+
+	template <typename... Types>
+	struct FieldCodec<std::tuple<Types...>> : TupleCodec<std::tuple<Types...>>
+	{
+	};
+
+#if __cplusplus >= 201703L
+	//A flag byte, then the value when there is one
+	template <typename T>
+	struct FieldCodec<std::optional<T>>
+	{
+		static size_t Size(std::optional<T> &optional)
+		{
+			return 1 + (optional ? FieldCodec<T>::Size(*optional) : 0);
+		}
+
+		static void Write(char *&out, std::optional<T> &optional)
+		{
+			*out++ = optional ? 1 : 0;
+			if (optional)
+			{
+				FieldCodec<T>::Write(out, *optional);
+			}
+		}
+
+		static void Read(FieldReader &in, std::optional<T> &optional)
+		{
+			char present = 0;
+			in.Take(&present, 1);
+			optional.reset();
+			if (present)
+			{
+				optional.emplace();
+				FieldCodec<T>::Read(in, *optional);
+			}
+		}
+	};
+#endif
+
+	//Serializer derived from the type: structs declared with DSPAR_SERIALIZABLE and their fields (trivial types,
+	//std::string, std::vector, std::array, std::pair, std::tuple, std::optional with C++17, nested declared
+	//structs). The item is measured first, then packed into one buffer sent as a single part, so it travels as
+	//one message (two above DSPAR_SEGMENT_COPY_THRESHOLD with separate framing: its size, then the buffer in place).
+	template <typename T>
+	class StructSendReceive : public SenderReceiver<T>
+	{
+	private:
+		std::vector<char> buffer;
+
+	public:
+		void Send(MPISender &sender, MessageHeader &msg, T &data) override
+		{
+			buffer.resize(FieldCodec<T>::Size(data));
+			char *out = buffer.data();
+			FieldCodec<T>::Write(out, data);
+			sender.SendTo(msg, buffer);
+		}
+
+		T Receive(MPIReceiver &receiver, MessageHeader &msg) override
+		{
+			buffer.clear();
+			receiver.Receive(msg, &buffer);
+			FieldReader in(buffer.data(), buffer.size());
+			T data = T();
+			FieldCodec<T>::Read(in, data);
+			if (in.failed || in.cursor != in.end)
+			{
+				SERDE_ERROR("Packed struct of " << buffer.size() << " bytes from " << msg.sender << " does not match its fields. Aborting to prevent errors");
+				MPI_Abort(receiver.GetComm(), 1);
+			}
+			return data;
+		}
+	};
+} // namespace dspar
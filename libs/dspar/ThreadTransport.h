@@ -0,0 +1,304 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include "Transport.h"
+
+namespace dspar
+{
+	//Lock-free multiple producer, single consumer queue (Vyukov). Push never blocks,
+	//only the owning node pops.
+	template <typename T>
+	class MPSCQueue
+	{
+	private:
+		struct Node
+		{
+			std::atomic<Node *> next;
+			T value;
+		};
+
+		std::atomic<Node *> head;
+		Node *tail;
+
+	public:
+		MPSCQueue()
+		{
+			Node *stub = new Node();
+			stub->next.store(NULL, std::memory_order_relaxed);
+			head.store(stub);
+			tail = stub;
+		}
+
+		~MPSCQueue()
+		{
+			T value;
+			while (TryPop(value))
+			{
+			}
+			delete tail;
+		}
+
+		void Push(T value)
+		{
+			Node *node = new Node();
+			node->value = std::move(value);
+			node->next.store(NULL, std::memory_order_relaxed);
+			Node *previous = head.exchange(node, std::memory_order_acq_rel);
+			previous->next.store(node, std::memory_order_release);
+		}
+
+		bool TryPop(T &value)
+		{
+			Node *next = tail->next.load(std::memory_order_acquire);
+			if (next == NULL)
+			{
+				return false;
+			}
+			value = std::move(next->value);
+			delete tail;
+			tail = next;
+			return true;
+		}
+
+		bool IsEmpty()
+		{
+			return tail->next.load(std::memory_order_acquire) == NULL;
+		}
+	};
+
+	//A message as it travels between threads: the header plus either serialized bytes or the items themselves
+	struct ThreadEnvelope
+	{
+		MessageHeader header;
+		std::vector<char> bytes;
+		std::shared_ptr<void> object;
+	};
+
+	//Queues of one node. The consumer spins briefly, then sleeps until a producer wakes it up.
+	struct ThreadMailbox
+	{
+		MPSCQueue<ThreadEnvelope> messages;
+		MPSCQueue<DemandSignal> demands;
+
+		std::mutex mutex;
+		std::condition_variable wakeUp;
+		std::atomic<bool> sleeping;
+
+		ThreadMailbox() : sleeping(false) {}
+
+		template <typename T>
+		void Push(MPSCQueue<T> &queue, T value)
+		{
+			queue.Push(std::move(value));
+			if (sleeping.load())
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				wakeUp.notify_one();
+			}
+		}
+
+		template <typename T>
+		T Pop(MPSCQueue<T> &queue)
+		{
+			T value;
+			for (int spin = 0; spin < 64; spin++)
+			{
+				if (queue.TryPop(value))
+				{
+					return value;
+				}
+				std::this_thread::yield();
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				sleeping.store(true);
+				if (queue.TryPop(value))
+				{
+					sleeping.store(false);
+					return value;
+				}
+				wakeUp.wait_for(lock, std::chrono::milliseconds(1));
+			}
+		}
+	};
+
+	//Mailboxes shared by all the threads of one run, indexed by rank
+	class ThreadTransportHub
+	{
+	private:
+		std::vector<std::unique_ptr<ThreadMailbox>> mailboxes;
+
+		std::mutex barrierMutex;
+		std::condition_variable barrierDone;
+		int barrierArrived;
+		int barrierGeneration;
+
+	public:
+		ThreadTransportHub(int numberOfNodes) : barrierArrived(0), barrierGeneration(0)
+		{
+			for (int i = 0; i < numberOfNodes; i++)
+			{
+				mailboxes.push_back(std::unique_ptr<ThreadMailbox>(new ThreadMailbox()));
+			}
+		}
+
+		ThreadMailbox &Mailbox(int rank)
+		{
+			return *mailboxes[rank];
+		}
+
+		int Size()
+		{
+			return (int)mailboxes.size();
+		}
+
+		void Barrier()
+		{
+			std::unique_lock<std::mutex> lock(barrierMutex);
+			int generation = barrierGeneration;
+			if (++barrierArrived == Size())
+			{
+				barrierArrived = 0;
+				barrierGeneration++;
+				barrierDone.notify_all();
+				return;
+			}
+			barrierDone.wait(lock, [&]() { return generation != barrierGeneration; });
+		}
+	};
+
+	//In-process transport of one node. Items are moved between stages as objects, the serializers are not used.
+	class ThreadTransport : public Transport
+	{
+	private:
+		ThreadTransportHub &hub;
+		int rank;
+		ThreadEnvelope outgoing;
+		ThreadEnvelope incoming;
+		size_t incomingCursor;
+
+	public:
+		ThreadTransport(ThreadTransportHub &_hub, int _rank) : hub(_hub), rank(_rank), incomingCursor(0) {}
+
+		int GetMyRank() override
+		{
+			return rank;
+		}
+
+		int GetSize() override
+		{
+			return hub.Size();
+		}
+
+		void Barrier() override
+		{
+			hub.Barrier();
+		}
+
+		void BeginMessage(MessageHeader &header) override
+		{
+			outgoing = ThreadEnvelope();
+			outgoing.header = header;
+		}
+
+		void SendBytes(const MessageHeader &, const void *data, size_t bytes) override
+		{
+			const char *begin = (const char *)data;
+			outgoing.bytes.insert(outgoing.bytes.end(), begin, begin + bytes);
+		}
+
+		void SendObject(const MessageHeader &, std::shared_ptr<void> object) override
+		{
+			outgoing.object = std::move(object);
+		}
+
+		void FinishMessage(MessageHeader &header) override
+		{
+			header.framing = FRAME_SEPARATE;
+			header.payloadBytes = outgoing.bytes.size();
+			outgoing.header = header;
+			ThreadMailbox &mailbox = hub.Mailbox(header.target);
+			mailbox.Push(mailbox.messages, std::move(outgoing));
+			outgoing = ThreadEnvelope();
+		}
+
+		MessageHeader ReceiveHeader() override
+		{
+			ThreadMailbox &mailbox = hub.Mailbox(rank);
+			incoming = mailbox.Pop(mailbox.messages);
+			incomingCursor = 0;
+			return incoming.header;
+		}
+
+		void ReceiveBytes(MessageHeader &, void *data, size_t bytes) override
+		{
+			if (incoming.bytes.size() - incomingCursor < bytes)
+			{
+				LOG_ERROR_AND_THROW("Message too short, the serializers of both ends do not match");
+			}
+			memcpy(data, incoming.bytes.data() + incomingCursor, bytes);
+			incomingCursor += bytes;
+		}
+
+		bool HasMessageWaiting() override
+		{
+			return !hub.Mailbox(rank).messages.IsEmpty();
+		}
+
+		void SendDemand(const DemandSignal &demand) override
+		{
+			ThreadMailbox &mailbox = hub.Mailbox(demand.target);
+			mailbox.Push(mailbox.demands, demand);
+		}
+
+		DemandSignal ReceiveDemand() override
+		{
+			ThreadMailbox &mailbox = hub.Mailbox(rank);
+			return mailbox.Pop(mailbox.demands);
+		}
+
+		bool TryReceivingDemand(DemandSignal &demand) override
+		{
+			return hub.Mailbox(rank).demands.TryPop(demand);
+		}
+
+		bool MovesObjects() override
+		{
+			return true;
+		}
+
+		std::shared_ptr<void> ReceiveObject(MessageHeader &) override
+		{
+			return std::move(incoming.object);
+		}
+	};
+
+	//Runs program once per node, each on its own thread with a ThreadTransport, without MPI.
+	//Like an MPI process, each thread must build its own stages and graph inside program and start it
+	//with the communicator it receives. numberOfNodes is the graph's GetTotalNumberOfProcessesNeeded().
+	void StartInThreads(int numberOfNodes, std::function<void(MPI_Comm)> program)
+	{
+		ThreadTransportHub hub(numberOfNodes);
+		std::vector<std::thread> threads;
+		for (int rank = 0; rank < numberOfNodes; rank++)
+		{
+			threads.push_back(std::thread([&hub, &program, rank]() {
+				ThreadTransport transport(hub, rank);
+				CurrentTransport() = &transport;
+				program(MPI_COMM_NULL);
+				CurrentTransport() = NULL;
+			}));
+		}
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+	}
+} // namespace dspar
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include "Message.h"
+#include "DemandSignal.h"
+#include "AsyncMPIRequest.h"
+#include "DatatypeCache.h"
+
+namespace dspar
+{
+	class StreamChannels;
+
+	//Moves message headers, payload bytes and demand signals between the nodes of a graph.
+	//MPISender and MPIReceiver only call this interface: nodes use MPITransport unless the thread
+	//running them has another transport set with CurrentTransport().
+	class Transport
+	{
+	public:
+		virtual ~Transport() {}
+
+		virtual int GetMyRank() = 0;
+		virtual int GetSize() = 0;
+		virtual void Barrier() = 0;
+
+		//Starts a message to header.target, payload bytes or an object may follow until FinishMessage.
+		//The transport may fill in fields of header that the receiver needs, such as its partTag.
+		virtual void BeginMessage(MessageHeader &header) = 0;
+		virtual void SendBytes(const MessageHeader &header, const void *data, size_t bytes) = 0;
+		virtual void FinishMessage(MessageHeader &header) = 0;
+
+		//Sends all blocks as one payload part
+		virtual void SendBlocks(const MessageHeader &header, const BlockList &list)
+		{
+			for (size_t i = 0; i < list.blocks.size(); i++)
+			{
+				SendBytes(header, list.blocks[i], list.lengths[i]);
+			}
+		}
+
+		//Sends the fixed prefix of an item followed by its segments, read with ReceiveSegmentPrefix and ReceiveSegments
+		virtual void SendSegments(const MessageHeader &header, const void *prefix, size_t prefixBytes, const BlockList &segments)
+		{
+			SendBytes(header, prefix, prefixBytes);
+			SendBlocks(header, segments);
+		}
+
+		//Sends count followed by bytes of data, read with ReceiveSized
+		virtual void SendSized(const MessageHeader &header, size_t count, const void *data, size_t bytes)
+		{
+			SendBytes(header, &count, sizeof(size_t));
+			if (count > 0)
+			{
+				SendBytes(header, data, bytes);
+			}
+		}
+
+		virtual void SendStop(MessageHeader &header)
+		{
+			BeginMessage(header);
+			FinishMessage(header);
+		}
+
+		//Blocks until a header arrives, its payload is then read with ReceiveBytes or ReceiveObject
+		virtual MessageHeader ReceiveHeader() = 0;
+		virtual void ReceiveBytes(MessageHeader &header, void *data, size_t bytes) = 0;
+		virtual bool HasMessageWaiting() = 0;
+
+		virtual void ReceiveBlocks(MessageHeader &header, const BlockList &list)
+		{
+			for (size_t i = 0; i < list.blocks.size(); i++)
+			{
+				ReceiveBytes(header, list.blocks[i], list.lengths[i]);
+			}
+		}
+
+		virtual void ReceiveSegmentPrefix(MessageHeader &header, void *prefix, size_t prefixBytes)
+		{
+			ReceiveBytes(header, prefix, prefixBytes);
+		}
+
+		virtual void ReceiveSegments(MessageHeader &header, const BlockList &segments)
+		{
+			ReceiveBlocks(header, segments);
+		}
+
+		//allocate(count) returns where count elements of elementSize bytes go
+		virtual void ReceiveSized(MessageHeader &header, size_t elementSize, const std::function<void *(size_t)> &allocate)
+		{
+			size_t count;
+			ReceiveBytes(header, &count, sizeof(size_t));
+			if (count > 0)
+			{
+				ReceiveBytes(header, allocate(count), count * elementSize);
+			}
+		}
+
+		virtual AsyncMPIRequest<MessageHeader> ReceiveHeaderAsync()
+		{
+			AsyncMPIRequest<MessageHeader> request;
+			request.Data() = ReceiveHeader();
+			return request;
+		}
+
+		virtual void SendDemand(const DemandSignal &demand) = 0;
+		virtual DemandSignal ReceiveDemand() = 0;
+		virtual bool TryReceivingDemand(DemandSignal &demand) = 0;
+
+		//Sends that do not block return a handle that is already completed
+		virtual AsyncMPIRequest<DemandSignal> SendDemandAsync(const DemandSignal &demand)
+		{
+			AsyncMPIRequest<DemandSignal> request;
+			request.Data() = demand;
+			SendDemand(demand);
+			return request;
+		}
+
+		//Sends still in flight, completed before the node stops
+		virtual void ReapCompletedSends() {}
+		virtual void WaitForPendingSends() {}
+		virtual size_t PendingSendsCount() { return 0; }
+		//Called when the node stops receiving, before it stops sending
+		virtual void StopReceiving() {}
+
+		//Wire options of the MPI transport (see MPISender and MPIReceiver), ignored by the others
+		virtual void SetSingleBufferFraming(bool) {}
+		virtual void SetEagerPayloadThreshold(size_t) {}
+		virtual void SetPersistentPartSize(size_t) {}
+		virtual void SetMaxInFlightSendsPerTarget(int) {}
+		virtual void SetPrefetchDepth(int, bool) {}
+		virtual void SetFixedWireSize(size_t) {}
+		virtual void SetStreamChannels(StreamChannels *) {}
+
+		//Transports inside one address space may hand over the emitted objects instead of serializing them
+		virtual bool MovesObjects() { return false; }
+		virtual void SendObject(const MessageHeader &, std::shared_ptr<void>) {}
+		virtual std::shared_ptr<void> ReceiveObject(MessageHeader &) { return std::shared_ptr<void>(); }
+	};
+
+	//Transport of the node running on the calling thread, NULL when nodes use MPI directly
+	Transport *&CurrentTransport()
+	{
+		static thread_local Transport *current = NULL;
+		return current;
+	}
+} // namespace dspar
@@ -2,6 +2,7 @@
 
 //#define ENABLE_SERDE_LOG
 #define ENABLE_NODE_LOG
+//Makes on-demand workers send demand signals with MPI_Isend by default (see FarmPattern::SetAsyncDemand)
 //#define ASYNC_DEMAND
 
 #ifdef WINDOWS
@@ -55,6 +56,11 @@
 #define TEST_PASSED(x) std::cout << "\033[14;32m" \
 								 << "TEST " << x << " PASSED  \033[0m" << std::endl
 
+//Probe every received part and check its size before receiving it, instead of trusting the sender
+#if defined(DSPARDEBUG) && !defined(DSPAR_VALIDATE_SIZES)
+#define DSPAR_VALIDATE_SIZES
+#endif
+
 #ifdef ENABLE_SERDE_LOG
 #define SERDE_DEBUG(x) LOG_DEBUG(x)
 #define SERDE_ERROR(x) LOG_ERROR(x)
@@ -67,18 +73,75 @@ const int MPI_DSPAR_STOP = 0;
 const int MPI_DSPAR_MESSAGE_BOUNDARY = 1;
 const int MPI_DSPAR_STREAM_MESSAGE = 2;
 const int MPI_DSPAR_DEMAND = 3;
+//With several threads receiving on a rank, the parts of each item use their own tag from here up to MPI_TAG_UB
+const int MPI_DSPAR_FIRST_PART_TAG = 16;
+
+//Framing flags of a MessageHeader. FRAME_SEPARATE means each SendTo call is its own MPI message.
+const uint32_t FRAME_SEPARATE = 0;
+//The packed payload follows the header inside the same MPI message
+const uint32_t FRAME_INLINE = 1;
+//The packed payload is sent as a single MPI_DSPAR_STREAM_MESSAGE right after the header
+const uint32_t FRAME_PACKED_TAIL = 2;
+//Header and payload were written to the receiver's ring (shared memory or RMA window)
+const uint32_t FRAME_RING = 3;
+
+//Largest packed payload that goes inside the header message when single buffer framing is enabled.
+//The receiver keeps a buffer of this size (plus the header) to receive headers without probing.
+#ifndef DSPAR_INLINE_PAYLOAD_CAPACITY
+#define DSPAR_INLINE_PAYLOAD_CAPACITY 65536
+#endif
+
+//Default payload size below which items are sent inline with their header even with separate framing.
+//0 keeps one message per part unless a farm enables it (see SetEagerPayloadThreshold); 256 suits small items.
+#ifndef DSPAR_EAGER_PAYLOAD_THRESHOLD
+#define DSPAR_EAGER_PAYLOAD_THRESHOLD 0
+#endif
+
+//Segmented items up to this size (prefix included) are copied into one contiguous MPI message,
+//larger ones send the prefix and then all segments at once with a derived datatype
+#ifndef DSPAR_SEGMENT_COPY_THRESHOLD
+#define DSPAR_SEGMENT_COPY_THRESHOLD 16384
+#endif
+
+//Payload parts larger than this travel as consecutive chunks of this size, posted together so their transfers
+//overlap (see MPIUtils::SetChunkSize). Chunks are never larger than DSPAR_MAX_CHUNK_BYTES, so every MPI count
+//fits an int whatever the size of the item.
+#ifndef DSPAR_CHUNK_BYTES
+#define DSPAR_CHUNK_BYTES (4 << 20)
+#endif
+#define DSPAR_MAX_CHUNK_BYTES (1 << 30)
+
+//Staging slots per target for parts sent with persistent requests (see MPISender::SetPersistentPartSize)
+#ifndef DSPAR_PERSISTENT_SLOTS
+#define DSPAR_PERSISTENT_SLOTS 4
+#endif
 
 const int MESSAGE_TYPE = 0;
 const int STOP_TYPE = 1;
 const int NO_MORE_DEMAND_TYPE = 1;
 
+//Demand signals between work-stealing workers. A request asks a peer for some of its queued messages.
+const int STEAL_REQUEST = 1;
+//Answers a request: amount is the number of messages sent before it, acked is 1 when the peer is out of work for good
+const int STEAL_REPLY = 2;
+//The sender will not steal anymore
+const int STEAL_FAREWELL = 3;
+//Service rate of a worker for the weighted emitter: amount items processed at rate, acked is 1 on the last report
+const int RATE_REPORT = 4;
+
 #include "Message.h"
 #include "CircularVector.h"
 #include "DSParNodeConfiguration.h"
 #include "Timings.h"
 #include "Globals.h"
 #include "DemandSignal.h"
+#include "Transport.h"
+#include "ThreadTransport.h"
 #include "MPIUtils.h"
+#include "StreamChannels.h"
+#include "SharedMemoryChannels.h"
+#include "RMAChannels.h"
+#include "MPITransport.h"
 #include "MPIReceiver.h"
 #include "MPISender.h"
 #include "DSparLifecycle.h"
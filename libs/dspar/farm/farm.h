@@ -38,6 +38,24 @@ namespace dspar
 		SenderReceiver<CollectorOutput> &collectorToWorld;
 		bool collectorIsOrdered = false;
 		bool useOnDemandScheduling = false;
+		bool singleBufferFraming = false;
+		int eagerPayloadBytes = DSPAR_EAGER_PAYLOAD_THRESHOLD;
+		int maxInFlightSendsPerTarget = 0;
+		int prefetchDepth = 0;
+		bool prefetchPayloads = true;
+		int batchSize = 1;
+		long batchTimeoutMicroseconds = 0;
+		int demandCredits = 1;
+		int creditUpdateInterval = 0;
+		long creditUpdateTimeoutMicroseconds = 0;
+		bool asyncDemand = DSParNodeConfiguration().AsyncDemand;
+		bool workStealing = false;
+		bool weightedScheduling = false;
+		long weightedReportIntervalMicroseconds = DSParNodeConfiguration().RateReportIntervalMicroseconds;
+		bool joinShortestQueue = false;
+		long shortestQueueReportIntervalMicroseconds = 10000;
+		std::function<size_t(EmitterOutput &)> routingKey;
+		bool consistentHashing = false;
 
 	public:
 		FarmPattern(
@@ -108,6 +126,30 @@ namespace dspar
 			auto rankIsCollector = std::find(collectorRanks.begin(), collectorRanks.end(), myRank) != collectorRanks.end();
 
 			DSParNodeConfiguration nodeConfig;
+			nodeConfig.SingleBufferFraming = singleBufferFraming;
+			nodeConfig.EagerPayloadBytes = eagerPayloadBytes;
+			nodeConfig.MaxInFlightSendsPerTarget = maxInFlightSendsPerTarget;
+			nodeConfig.PrefetchDepth = prefetchDepth;
+			nodeConfig.PrefetchPayloads = prefetchPayloads;
+			nodeConfig.BatchSize = batchSize;
+			nodeConfig.BatchTimeoutMicroseconds = batchTimeoutMicroseconds;
+			nodeConfig.DemandCredits = demandCredits;
+			nodeConfig.CreditUpdateInterval = creditUpdateInterval;
+			nodeConfig.CreditUpdateTimeoutMicroseconds = creditUpdateTimeoutMicroseconds;
+			nodeConfig.AsyncDemand = asyncDemand;
+			//each policy replaces the ones after it: key routing, work stealing, on-demand, join-shortest-queue, weighted
+			bool keyRouting = (bool)routingKey;
+			bool stealing = workStealing && !keyRouting;
+			bool onDemand = useOnDemandScheduling && !stealing && !keyRouting;
+			bool shortestQueue = joinShortestQueue && !onDemand && !stealing && !keyRouting;
+			bool weighted = weightedScheduling && !shortestQueue && !onDemand && !stealing && !keyRouting;
+			nodeConfig.RateReportIntervalMicroseconds = shortestQueue ? shortestQueueReportIntervalMicroseconds : weightedReportIntervalMicroseconds;
+
+			//checked on every rank of the farm so they all stop, not only the emitter
+			if (keyRouting && collectorIsOrdered && !inputRanks.empty())
+			{
+				LOG_ERROR_AND_THROW("Key routing cannot be used with an ordered collector when the emitter has inputs");
+			}
 
 			if (rankIsEmitter)
 			{
@@ -118,25 +160,33 @@ namespace dspar
 					LOG_ERROR_AND_THROW("Cannot run more than 1 emitter node");
 				}
 
-				if (useOnDemandScheduling)
+				if (onDemand)
 				{
 					nodeConfig.WaitForDemandDownstream = true;
 					nodeConfig.AskForDemandUpstream = false;
 				}
+				nodeConfig.WeightByServiceRateDownstream = weighted;
+				nodeConfig.JoinShortestQueueDownstream = shortestQueue;
 
 				DSparNode<EmitterInput, EmitterOutput> farmEmitter(
 					emitter, worldToEmitter,
 					emitterToWorkers, workerRanks,
 					inputRanks, nodeConfig);
+				if (keyRouting)
+				{
+					farmEmitter.SetRoutingKey(routingKey, consistentHashing);
+				}
 				farmEmitter.StartNode(comm);
 			}
 			else if (rankIsWorker)
 			{
-				if (useOnDemandScheduling)
+				if (onDemand)
 				{
 					nodeConfig.WaitForDemandDownstream = false;
 					nodeConfig.AskForDemandUpstream = true;
 				}
+				nodeConfig.WorkStealing = stealing;
+				nodeConfig.ReportServiceRateUpstream = weighted || shortestQueue;
 
 				TRBLOCK("Worker");
 
@@ -146,6 +196,10 @@ namespace dspar
 					collectorRanks,
 					emitterRanks, nodeConfig);
 
+				if (stealing)
+				{
+					farmWorkerNode.SetStealPeers(workerRanks, myRank);
+				}
 				farmWorkerNode.StartNode(comm);
 			}
 			else if (rankIsCollector)
@@ -187,6 +241,117 @@ namespace dspar
 			this->useOnDemandScheduling = _onDemandScheduling;
 		}
 
+		//With on-demand scheduling, each worker may have up to credits messages sent to it and not yet
+		//processed. Workers return credits in bulk (half the window at a time, or all when idle).
+		void SetDemandCredits(int credits)
+		{
+			this->demandCredits = credits > 0 ? credits : 1;
+		}
+
+		//Workers acknowledge processed messages in one credit update every items messages (capped at the
+		//credit window), or once the oldest unacknowledged message is timeoutMicroseconds old.
+		//Unlike the default, idle workers keep their credits until the interval or the timer is reached.
+		void SetDemandCoalescing(int items, long timeoutMicroseconds = 0)
+		{
+			this->creditUpdateInterval = items;
+			this->creditUpdateTimeoutMicroseconds = timeoutMicroseconds;
+		}
+
+		//The emitter sends items round robin and each worker queues what it received. An idle worker asks
+		//the other workers in turn for half of their queued messages, without going through the emitter.
+		//Replaces on-demand scheduling when both are set.
+		void SetWorkStealing(bool _workStealing)
+		{
+			this->workStealing = _workStealing;
+		}
+
+		//Workers report their service rate (items per second of processing time) every reportIntervalMicroseconds
+		//and the emitter sends them items in proportion to it, so slower or busier nodes get fewer. The smoothed
+		//rates end up in globals::workerWeights. Replaced by any other scheduling policy that is set.
+		void SetWeightedScheduling(bool _weightedScheduling, long reportIntervalMicroseconds = 100000)
+		{
+			this->weightedScheduling = _weightedScheduling;
+			this->weightedReportIntervalMicroseconds = reportIntervalMicroseconds;
+		}
+
+		//Workers report their service rate, the items they received and those still queued, and how long the
+		//current one has been running, at most every reportIntervalMicroseconds and whenever they run out of
+		//items. When sends may come from two threads (as for SetBatchTimeout), they also report while a long
+		//item runs if they received or finished items since. The emitter estimates the seconds of work each
+		//worker has left and sends each message to the less loaded of two workers picked at random. Replaces
+		//weighted scheduling, and is replaced by on-demand scheduling, work stealing or key routing.
+		void SetJoinShortestQueue(bool _joinShortestQueue, long reportIntervalMicroseconds = 10000)
+		{
+			this->joinShortestQueue = _joinShortestQueue;
+			this->shortestQueueReportIntervalMicroseconds = reportIntervalMicroseconds;
+		}
+
+		//Sends every item to the worker hash(keyOf(item)) maps to, so items with the same key reach the same worker,
+		//which may keep state per key. keyOf returns any type std::hash supports. consistentHashing uses a hash
+		//ring instead of the hash modulo the number of workers, moving fewer keys when the replicas change.
+		//Replaces the other scheduling policies. Batches are split into runs of items of the same worker. An
+		//emitter with inputs sends every run under the id of the input message, which an ordered collector
+		//cannot put back in order, so Start throws when both are set on a farm with inputs.
+		template <typename KeyOf>
+		void SetKeyRouting(KeyOf keyOf, bool _consistentHashing = false)
+		{
+			this->routingKey = [keyOf](EmitterOutput &item) {
+				auto key = keyOf(item);
+				return std::hash<decltype(key)>()(key);
+			};
+			this->consistentHashing = _consistentHashing;
+		}
+
+		//Workers post demand signals with MPI_Isend instead of blocking on MPI_Send.
+		//Defaults to true when ASYNC_DEMAND is defined.
+		void SetAsyncDemand(bool _asyncDemand)
+		{
+			this->asyncDemand = _asyncDemand;
+		}
+
+		//Sends each item (header and all serializer parts) as a single MPI message
+		void SetSingleBufferFraming(bool _singleBufferFraming)
+		{
+			this->singleBufferFraming = _singleBufferFraming;
+		}
+
+		//Items whose payload is at most bytes are sent inline with their header in one message even
+		//without single buffer framing, larger ones keep one message per part (0 = always separate, the default)
+		void SetEagerPayloadThreshold(int bytes)
+		{
+			this->eagerPayloadBytes = bytes;
+		}
+
+		//Emits with non-blocking sends, allowing up to maxInFlight pending items per target rank (0 = blocking)
+		void SetEmitWindow(int maxInFlight)
+		{
+			this->maxInFlightSendsPerTarget = maxInFlight;
+		}
+
+		//Keeps the next depth items posted with MPI_Irecv while the current one is processed.
+		//prefetchPayloads also posts the receive of large packed payloads ahead of time.
+		void SetPrefetchDepth(int depth, bool _prefetchPayloads = true)
+		{
+			this->prefetchDepth = depth;
+			this->prefetchPayloads = _prefetchPayloads;
+		}
+
+		//Sends up to batchSize items per MPI message. Batches are formed where items are produced
+		//(the emitter's Produce); workers and the collector send the outputs of one received batch
+		//together under the batch id, so ordering and on-demand scheduling work per batch.
+		void SetBatchSize(int _batchSize)
+		{
+			this->batchSize = _batchSize;
+		}
+
+		//Sends a partial batch once its first item has waited this long. It is checked on each emit, and by a
+		//timer thread while the emitter produces when sends may come from two threads: MPI initialized with
+		//MPIUtils::SetThreadMultiple, or the graph run with StartInThreads.
+		void SetBatchTimeout(long microseconds)
+		{
+			this->batchTimeoutMicroseconds = microseconds;
+		}
+
 		void SetWorkerReplicas(int _workerReplicas)
 		{
 			this->workerReplicas = _workerReplicas;
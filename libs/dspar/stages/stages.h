@@ -25,6 +25,13 @@ namespace dspar
         SenderReceiver<TIn> &inputReceiver;
         SenderReceiver<TOut> &outputSender;
         bool ordered = false;
+        bool singleBufferFraming = false;
+        int eagerPayloadBytes = DSPAR_EAGER_PAYLOAD_THRESHOLD;
+        int maxInFlightSendsPerTarget = 0;
+        int prefetchDepth = 0;
+        bool prefetchPayloads = true;
+        int batchSize = 1;
+        long batchTimeoutMicroseconds = 0;
 
     public:
         PipelineStage(Wrapper<TIn, TOut> &_stage,
@@ -39,6 +46,31 @@ namespace dspar
             this->ordered = ordered;
         }
 
+        void SetSingleBufferFraming(bool _singleBufferFraming) {
+            this->singleBufferFraming = _singleBufferFraming;
+        }
+
+        void SetEagerPayloadThreshold(int bytes) {
+            this->eagerPayloadBytes = bytes;
+        }
+
+        void SetEmitWindow(int maxInFlight) {
+            this->maxInFlightSendsPerTarget = maxInFlight;
+        }
+
+        void SetPrefetchDepth(int depth, bool _prefetchPayloads = true) {
+            this->prefetchDepth = depth;
+            this->prefetchPayloads = _prefetchPayloads;
+        }
+
+        void SetBatchSize(int _batchSize) {
+            this->batchSize = _batchSize;
+        }
+
+        void SetBatchTimeout(long microseconds) {
+            this->batchTimeoutMicroseconds = microseconds;
+        }
+
         int Start(MPI_Comm comm, int startingRank,
                   std::vector<int> inputRanks,
                   std::vector<int> outputRanks) override
@@ -59,6 +91,13 @@ namespace dspar
             nodeConfig.AskForDemandUpstream = false;
             nodeConfig.Ordered = ordered;
             nodeConfig.WaitForDemandDownstream = false;
+            nodeConfig.SingleBufferFraming = singleBufferFraming;
+            nodeConfig.EagerPayloadBytes = eagerPayloadBytes;
+            nodeConfig.MaxInFlightSendsPerTarget = maxInFlightSendsPerTarget;
+            nodeConfig.PrefetchDepth = prefetchDepth;
+            nodeConfig.PrefetchPayloads = prefetchPayloads;
+            nodeConfig.BatchSize = batchSize;
+            nodeConfig.BatchTimeoutMicroseconds = batchTimeoutMicroseconds;
 
             DSparNode<TIn, TOut> pipeStage(stage, inputReceiver, outputSender,
                                                    outputRanks, inputRanks, nodeConfig);
@@ -125,5 +125,20 @@ void MeasureTime(F function, int parallelism, int rank, I *throughput)
                   << std::endl;
     }
 
+    if (dspar::globals::isEmitter && dspar::globals::demandSignalsReceived > 0)
+    {
+        std::cout << "demandSignals: " << dspar::globals::demandSignalsReceived << "\t"
+                  << "controlMessagesSaved: " << dspar::globals::controlMessagesSaved << std::endl;
+    }
+
+    if (dspar::globals::isEmitter && !dspar::globals::workerWeights.empty())
+    {
+        std::cout << "workerWeights:";
+        for (auto &weight : dspar::globals::workerWeights)
+        {
+            std::cout << "\t" << weight.first << ": " << weight.second;
+        }
+        std::cout << std::endl;
+    }
 
 }
@@ -0,0 +1,115 @@
+#include <cstdlib>
+#include <cstring>
+#include "dspar/farm/farm.h"
+#include "dspar/utils/Timer.h"
+
+// Compares the channels carrying stream items: two-sided MPI, shared memory rings and RMA rings.
+// Usage: mpirun -np 1 channel-benchmark.out <mpi|shm|rma> [items] [work] [replicas] [ring bytes]
+// Run once per channel with the same arguments and compare the times printed by the collector.
+
+// Source operator
+class Source : public dspar::Emitter<long>
+{
+private:
+    long items;
+
+public:
+    Source(long items)
+    {
+        this->items = items;
+    };
+
+    void Produce()
+    {
+        for (long i = 0; i < items; i++)
+        {
+            Emit(i);
+        }
+    };
+};
+
+// Middle operator, spins for a configurable number of iterations per item
+class Middle : public dspar::Worker<long, long>
+{
+private:
+    long work;
+
+public:
+    Middle(long work)
+    {
+        this->work = work;
+    };
+
+    void Process(long &i)
+    {
+        volatile long acc = i;
+        for (long j = 0; j < work; j++)
+        {
+            acc = acc * 31 + j;
+        }
+        Emit(i);
+    };
+};
+
+// Sink operator
+class Sink : public dspar::Collector<long>
+{
+public:
+    long received = 0;
+    void Process(long &)
+    {
+        received++;
+    };
+};
+
+int main(int argc, char **argv)
+{
+    const char *channel = argc > 1 ? argv[1] : "mpi";
+    long items = argc > 2 ? atol(argv[2]) : 100000;
+    long work = argc > 3 ? atol(argv[3]) : 0;
+    int replicas = argc > 4 ? atoi(argv[4]) : 2;
+    long ringBytes = argc > 5 ? atol(argv[5]) : 65536;
+
+    // Serializers
+    dspar::TrivialSendReceive<long> longSerializer;
+
+    // Operators
+    Source source(items);
+    Middle middle(work);
+    Sink sink;
+
+    // Farm
+    auto farm = dspar::Farm(
+        source, longSerializer,
+        middle, longSerializer,
+        sink
+    );
+
+    farm.SetCollectorIsOrdered(false);
+    farm.SetWorkerReplicas(replicas);
+
+    // Every process selects the same channel before starting the farm
+    dspar::MPIUtils mpiUtils;
+    if (strcmp(channel, "shm") == 0)
+    {
+        mpiUtils.SetSharedMemoryRingSize(ringBytes);
+    }
+    else if (strcmp(channel, "rma") == 0)
+    {
+        mpiUtils.SetRMARingSize(ringBytes);
+    }
+
+    // Initialize the MPI environment and create the required processes dynamically
+    MPI_Comm comm = mpiUtils.SetTotalNumberOfProcesses(argc, argv, farm.GetTotalNumberOfProcessesNeeded() - 1);
+
+    if (mpiUtils.GetMyRank(comm) == 0)
+    {
+        std::cout << channel << " channel, " << items << " items, " << replicas << " workers" << std::endl;
+    }
+
+    // Start the farm, the collector prints: workers, seconds, items per second
+    MeasureTime([&]() { farm.Start(comm, 0); }, replicas, mpiUtils.GetMyRank(comm), &sink.received);
+
+    // Finalize the MPI environment
+    MPI_Finalize();
+}
@@ -0,0 +1,109 @@
+#include <cstdlib>
+#include <cstring>
+#include "dspar/farm/farm.h"
+#include "dspar/utils/Timer.h"
+
+// Compares blocking and asynchronous demand signals of an on-demand farm.
+// Usage: mpirun -np 1 demand-benchmark.out <blocking|async> [items] [work] [replicas] [credits]
+// Run once per mode with the same arguments and compare the times printed by the collector.
+
+// Source operator
+class Source : public dspar::Emitter<long>
+{
+private:
+    long items;
+
+public:
+    Source(long items)
+    {
+        this->items = items;
+    };
+
+    void Produce()
+    {
+        for (long i = 0; i < items; i++)
+        {
+            Emit(i);
+        }
+    };
+};
+
+// Middle operator, spins for a configurable number of iterations per item
+class Middle : public dspar::Worker<long, long>
+{
+private:
+    long work;
+
+public:
+    Middle(long work)
+    {
+        this->work = work;
+    };
+
+    void Process(long &i)
+    {
+        volatile long acc = i;
+        for (long j = 0; j < work; j++)
+        {
+            acc = acc * 31 + j;
+        }
+        Emit(i);
+    };
+};
+
+// Sink operator
+class Sink : public dspar::Collector<long>
+{
+public:
+    long received = 0;
+    void Process(long &)
+    {
+        received++;
+    };
+};
+
+int main(int argc, char **argv)
+{
+    bool asyncDemand = argc > 1 && strcmp(argv[1], "async") == 0;
+    long items = argc > 2 ? atol(argv[2]) : 100000;
+    long work = argc > 3 ? atol(argv[3]) : 1000;
+    int replicas = argc > 4 ? atoi(argv[4]) : 2;
+    int credits = argc > 5 ? atoi(argv[5]) : 1;
+
+    // Serializers
+    dspar::TrivialSendReceive<long> longSerializer;
+
+    // Operators
+    Source source(items);
+    Middle middle(work);
+    Sink sink;
+
+    // Farm
+    auto farm = dspar::Farm(
+        source, longSerializer,
+        middle, longSerializer,
+        sink
+    );
+
+    farm.SetCollectorIsOrdered(false);
+    farm.SetOnDemandScheduling(true);
+    farm.SetAsyncDemand(asyncDemand);
+    farm.SetDemandCredits(credits);
+    farm.SetWorkerReplicas(replicas);
+
+    // Initialize the MPI environment and create the required processes dynamically
+    dspar::MPIUtils mpiUtils;
+    MPI_Comm comm = mpiUtils.SetTotalNumberOfProcesses(argc, argv, farm.GetTotalNumberOfProcessesNeeded() - 1);
+
+    if (mpiUtils.GetMyRank(comm) == 0)
+    {
+        std::cout << (asyncDemand ? "async" : "blocking") << " demand, " << items << " items, "
+                  << replicas << " workers, " << credits << " credits" << std::endl;
+    }
+
+    // Start the farm, the collector prints: workers, seconds, items per second
+    MeasureTime([&]() { farm.Start(comm, 0); }, replicas, mpiUtils.GetMyRank(comm), &sink.received);
+
+    // Finalize the MPI environment
+    MPI_Finalize();
+}
@@ -111,55 +111,40 @@ public:
     };
 };
 
-// Serializer for opencv Mat
-class MatSerializer : public dspar::SenderReceiver<cv::Mat>
+// Prefix of a serialized opencv Mat, its pixels follow as segments
+struct MatPrefix
 {
-    void Send(dspar::MPISender &sender, dspar::MessageHeader &msg, cv::Mat &data)
-    {
-        int type = data.type();
-        bool continuous = data.isContinuous();
+    int rows;
+    int cols;
+    int type;
+};
 
-        sender.SendTo(msg, data.rows);
-        sender.SendTo(msg, data.cols);
-        sender.SendTo(msg, type);
-        sender.SendTo(msg, continuous);
+// Serializer for opencv Mat, sends the prefix and the pixels as one message
+class MatSerializer : public dspar::SegmentSenderReceiver<cv::Mat, MatPrefix>
+{
+    void Describe(cv::Mat &data, MatPrefix &prefix, dspar::BlockList &segments)
+    {
+        prefix.rows = data.rows;
+        prefix.cols = data.cols;
+        prefix.type = data.type();
 
-        if (continuous)
+        const size_t row_size = data.cols * data.elemSize();
+        if (data.isContinuous())
         {
-            const int data_size = data.rows * data.cols * static_cast<int>(data.elemSize());
-            sender.SendTo(msg, data.ptr(), data_size);
+            segments.Add(data.ptr(), data.rows * row_size);
         }
         else
         {
-            const int row_size = data.cols * static_cast<int>(data.elemSize());
             for (int i = 0; i < data.rows; i++)
-                sender.SendTo(msg, data.ptr(i), row_size);
+                segments.Add(data.ptr(i), row_size);
         }
     };
 
-    cv::Mat Receive(dspar::MPIReceiver &receiver, dspar::MessageHeader &msg)
+    cv::Mat Allocate(MatPrefix &prefix, dspar::BlockList &segments)
     {
-        int rows, cols, type;
-        bool continuous;
-
-        receiver.Receive(msg, &rows);
-        receiver.Receive(msg, &cols);
-        receiver.Receive(msg, &type);
-        receiver.Receive(msg, &continuous);
-
-        cv::Mat data(rows, cols, type);
-        if (continuous)
-        {
-            const int data_size = rows * cols * static_cast<int>(data.elemSize());
-            receiver.Receive(msg, data.ptr(), data_size);
-        }
-        else
-        {
-            const int row_size = cols * static_cast<int>(data.elemSize());
-            for (int i = 0; i < rows; i++)
-                receiver.Receive(msg, data.ptr(i), row_size);
-        }
-
+        // A new Mat is continuous, its rows are received as one segment
+        cv::Mat data(prefix.rows, prefix.cols, prefix.type);
+        segments.Add(data.ptr(), data.rows * data.cols * data.elemSize());
         return data;
     };
 };
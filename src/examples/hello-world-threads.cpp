@@ -0,0 +1,72 @@
+#include "dspar/farm/farm.h"
+
+// Source operator
+class Source : public dspar::Emitter<int>
+{
+public:
+    void Produce()
+    {
+        for (int i = 0; i <= 100; i++)
+        {
+            Emit(i);
+        }
+    };
+};
+
+// Middle operator
+class Middle : public dspar::Worker<int, std::string>
+{
+public:
+    void Process(int &i)
+    {
+        std::string output = "Hello World " + std::to_string(i);
+        Emit(output);
+    };
+};
+
+// Sink operator
+class Sink : public dspar::Collector<std::string>
+{
+public:
+    void Process(std::string &data)
+    {
+        printf("%s\n", data.c_str());
+    };
+};
+
+// Serializers, stages and farm of one node. Like an MPI process, each node (thread) builds its own.
+struct HelloWorldFarm
+{
+    dspar::TrivialSendReceive<int> intSerializer;
+    dspar::TrivialSendReceive<std::string> stringSerializer;
+
+    Source source;
+    Middle middle;
+    Sink sink;
+
+    dspar::FarmPattern<dspar::Nothing, int, std::string, dspar::Nothing> farm;
+
+    HelloWorldFarm() : farm(dspar::Farm(
+                           source, intSerializer,
+                           middle, stringSerializer,
+                           sink))
+    {
+        farm.SetCollectorIsOrdered(false);
+        farm.SetOnDemandScheduling(true);
+        farm.SetWorkerReplicas(2);
+    }
+};
+
+int main()
+{
+    // One node (thread) per process the farm needs: emitter, collector and workers
+    int numberOfNodes = HelloWorldFarm().farm.GetTotalNumberOfProcessesNeeded();
+
+    // Items are moved between threads, the serializers are not called and MPI is not initialized.
+    dspar::StartInThreads(numberOfNodes, [](MPI_Comm comm) {
+        HelloWorldFarm node;
+
+        // Start the farm on this thread's node
+        node.farm.Start(comm, 0);
+    });
+}
@@ -3,11 +3,13 @@
 // Structure to store the line to render
 struct LineToRender
 {
-    char *M;
-    int size;
+    std::vector<char> M;
     int line;
 };
 
+// Fields sent by dspar::StructSendReceive<LineToRender>, packed in one buffer
+DSPAR_SERIALIZABLE(LineToRender, line, M)
+
 // Source operator
 class GenerateWork : public dspar::Wrapper<dspar::Nothing, LineToRender>
 {
@@ -24,9 +26,7 @@ public:
         for (int i = 0; i < numberOfLines; i++)
         {
             LineToRender lineToRender;
-            lineToRender.M = NULL;
             lineToRender.line = i;
-            lineToRender.size = 0;
             Emit(lineToRender);
         }
     };
@@ -58,7 +58,8 @@ public:
     void Process(LineToRender &lineToCalculate) override
     {
         int dim = dimensions;
-        char *M = new char[dimensions];
+        std::vector<char> &M = lineToCalculate.M;
+        M.resize(dimensions);
         int i = lineToCalculate.line;
         double im;
         im = init_b + (step * i);
@@ -79,8 +80,6 @@ public:
             }
             M[j] = (unsigned char)255 - ((k * 255 / niter));
         }
-        lineToCalculate.M = M;
-        lineToCalculate.size = dimensions;
         Emit(lineToCalculate);
     };
 };
@@ -91,37 +90,7 @@ class RenderLine : public dspar::Wrapper<LineToRender, dspar::Nothing>
 public:
     void Process(LineToRender &lineToRender)
     {
-        lineToRender.size = 0;
-        delete[] lineToRender.M;
-        lineToRender.M = NULL;
-    };
-};
-
-// Serializer for LineToRender
-class LineToRenderSerializer : public dspar::SenderReceiver<LineToRender>
-{
-    void Send(dspar::MPISender &sender, dspar::MessageHeader &msg, LineToRender &data)
-    {
-        sender.SendTo(msg, data.line);
-        sender.SendTo(msg, data.size);
-        if (data.size > 0)
-        {
-            sender.SendTo(msg, data.M, data.size);
-            delete[] data.M;
-        }
-    };
-    LineToRender Receive(dspar::MPIReceiver &receiver, dspar::MessageHeader &msg)
-    {
-        LineToRender data;
-        memset(&data, 0, sizeof(LineToRender));
-        receiver.Receive(msg, &data.line);
-        receiver.Receive(msg, &data.size);
-        if (data.size > 0)
-        {
-            data.M = new char[data.size];
-            receiver.Receive(msg, data.M, data.size);
-        }
-        return data;
+        lineToRender.M.clear();
     };
 };
 
@@ -133,7 +102,7 @@ int main(int argc, char **argv)
     double step = range / (double)dim;
 
     // Serializers
-    LineToRenderSerializer lineToRenderSerializer;
+    dspar::StructSendReceive<LineToRender> lineToRenderSerializer;
 
     // Operators
     GenerateWork gw(dim);
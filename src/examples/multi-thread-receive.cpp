@@ -0,0 +1,167 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include "dspar/farm/farm.h"
+
+// Receives the items of one sender on several threads of the same rank at once.
+// Usage: mpirun -np 1 multi-thread-receive.out [items] [threads]
+// Items alternate between inline, packed tail and separately framed payloads, the last split in chunks.
+// Each receiving thread has its own transport and checks every item it takes, then the rank checks that
+// every item arrived exactly once.
+
+const size_t EAGER_THRESHOLD = 256 * 1024;
+const size_t CHUNK_BYTES = 64 * 1024;
+
+// Number of values of item i: inline, packed tail or separate framing with chunked parts
+size_t ItemLength(long i)
+{
+    switch (i % 3)
+    {
+    case 0:
+        return 16;
+    case 1:
+        return 30000;
+    default:
+        return 150000;
+    }
+}
+
+int Value(long i, size_t k)
+{
+    return (int)(i * 7 + k);
+}
+
+void Send(MPI_Comm comm, long items, int stops)
+{
+    dspar::MPITransport transport(comm);
+    dspar::MPISender sender(comm, transport);
+    sender.SetEagerPayloadThreshold(EAGER_THRESHOLD);
+    // Asynchronous sends, so the headers of later items reach the receiver before the parts of earlier ones
+    sender.SetMaxInFlightSendsPerTarget(8);
+
+    for (long i = 0; i < items; i++)
+    {
+        std::vector<int> values(ItemLength(i));
+        for (size_t k = 0; k < values.size(); k++)
+        {
+            values[k] = Value(i, k);
+        }
+        dspar::MessageHeader header = sender.StartSendingMessageTo(1);
+        sender.SendTo(header, i);
+        sender.SendTo(header, values);
+        sender.FinishSendingMessage(header);
+    }
+    // One stop message per receiving thread
+    for (int t = 0; t < stops; t++)
+    {
+        sender.SendStopMessageTo(1);
+    }
+    sender.WaitForPendingSends();
+}
+
+void Receive(MPI_Comm comm, int thread, std::vector<std::atomic<int>> &seen, std::atomic<long> &corrupted, long &received)
+{
+    dspar::MPITransport transport(comm);
+    dspar::MPIReceiver receiver(comm, transport);
+
+    while (true)
+    {
+        dspar::MessageHeader header = receiver.StartReceivingMessage();
+        if (header.type == STOP_TYPE)
+        {
+            break;
+        }
+        // Odd threads pause between the header and the parts, so the other threads overtake them
+        if (thread % 2 == 1)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        long i;
+        std::vector<int> values;
+        receiver.Receive(header, &i);
+        receiver.Receive(header, &values);
+
+        bool intact = i >= 0 && i < (long)seen.size() && values.size() == ItemLength(i);
+        for (size_t k = 0; intact && k < values.size(); k++)
+        {
+            intact = values[k] == Value(i, k);
+        }
+        if (!intact)
+        {
+            corrupted++;
+            continue;
+        }
+        seen[i]++;
+        received++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long items = argc > 1 ? atol(argv[1]) : 3000;
+    int threads = argc > 2 ? atoi(argv[2]) : 2;
+
+    // Every process requests MPI_THREAD_MULTIPLE before MPI is initialized
+    dspar::MPIUtils mpiUtils;
+    mpiUtils.SetThreadMultiple(true);
+    mpiUtils.SetChunkSize(CHUNK_BYTES);
+    MPI_Comm comm = mpiUtils.SetTotalNumberOfProcesses(argc, argv, 1);
+
+    if (!dspar::globals::threadMultiple)
+    {
+        MPI_Finalize();
+        return 0;
+    }
+
+    int rank = mpiUtils.GetMyRank(comm);
+    if (rank == 0)
+    {
+        Send(comm, items, threads);
+    }
+    else if (rank == 1)
+    {
+        std::vector<std::atomic<int>> seen(items);
+        for (auto &count : seen)
+        {
+            count = 0;
+        }
+        std::atomic<long> corrupted(0);
+        std::vector<long> received(threads, 0);
+
+        std::vector<std::thread> receivers;
+        for (int t = 0; t < threads; t++)
+        {
+            receivers.emplace_back(Receive, comm, t, std::ref(seen), std::ref(corrupted), std::ref(received[t]));
+        }
+        for (auto &receiver : receivers)
+        {
+            receiver.join();
+        }
+
+        long missing = 0;
+        long duplicated = 0;
+        for (auto &count : seen)
+        {
+            missing += count == 0;
+            duplicated += count > 1;
+        }
+
+        std::cout << items << " items on " << threads << " threads, received per thread:";
+        for (long count : received)
+        {
+            std::cout << " " << count;
+        }
+        std::cout << std::endl;
+        if (missing == 0 && duplicated == 0 && corrupted == 0)
+        {
+            std::cout << "Every item received intact exactly once" << std::endl;
+        }
+        else
+        {
+            std::cout << "FAILED: " << missing << " missing, " << duplicated << " duplicated, " << corrupted << " corrupted" << std::endl;
+        }
+    }
+
+    MPI_Finalize();
+}